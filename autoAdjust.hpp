@@ -1,6 +1,7 @@
 #pragma once
 #include "jconf.h"
 #include "console.h"
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -32,11 +33,9 @@ public:
 		printer::inst()->print_str("The values are not optimal, please try to tweak the values based on notes in config.txt.\n");
 		printer::inst()->print_str("Please copy & paste the block within the asterisks to your config.\n\n");
 
-		if(!detectL3Size() || L3KB_size < 1024 || L3KB_size > 102400)
+		std::vector<jconf::thd_cfg> cfgs;
+		if(!getConfig(cfgs))
 		{
-			if(L3KB_size < 1024 || L3KB_size > 102400)
-				printer::inst()->print_msg(L0, "Autoconf failed: L3 size sanity check failed - %u KB.", L3KB_size);
-
 			printer::inst()->print_msg(L0, "Autoconf failed: Printing config for a single thread. Please try to add new ones until the hashrate slows down.");
 			printer::inst()->print_str("\n**************** Copy&Paste BEGIN ****************\n\n");
 			printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
@@ -45,6 +44,30 @@ public:
 			return;
 		}
 
+		printer::inst()->print_str("\n**************** Copy&Paste BEGIN ****************\n\n");
+		printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
+
+		char strbuf[256];
+		for(const jconf::thd_cfg& cfg : cfgs)
+		{
+			snprintf(strbuf, sizeof(strbuf), "   { \"low_power_mode\" : %s, \"no_prefetch\" : true, \"affine_to_cpu\" : %u },\n",
+				cfg.iMultiway == 2 ? "true" : "false", (uint32_t)cfg.iCpuAff);
+			printer::inst()->print_str(strbuf);
+		}
+
+		printer::inst()->print_str("],\n\n**************** Copy&Paste END ****************\n");
+	}
+
+	// L3 size based thread config, returns false if the cache size couldn't be detected
+	bool getConfig(std::vector<jconf::thd_cfg>& cfgs)
+	{
+		if(!detectL3Size() || L3KB_size < 1024 || L3KB_size > 102400)
+		{
+			if(L3KB_size < 1024 || L3KB_size > 102400)
+				printer::inst()->print_msg(L0, "Autoconf failed: L3 size sanity check failed - %u KB.", L3KB_size);
+			return false;
+		}
+
 		printer::inst()->print_msg(L0, "Autoconf L3 size detected at %u KB.", L3KB_size);
 
 		detectCPUConf();
@@ -52,11 +75,8 @@ public:
 		printer::inst()->print_msg(L0, "Autoconf core count detected as %u on %s.", corecnt,
 			linux_layout ? "Linux" : "Windows");
 
-		printer::inst()->print_str("\n**************** Copy&Paste BEGIN ****************\n\n");
-		printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
-
+		cfgs.clear();
 		uint32_t aff_id = 0;
-		char strbuf[256];
 		for(uint32_t i=0; i < corecnt; i++)
 		{
 			bool double_mode;
@@ -66,9 +86,11 @@ public:
 
 			double_mode = L3KB_size / 2048 > (int32_t)(corecnt-i);
 
-			snprintf(strbuf, sizeof(strbuf), "   { \"low_power_mode\" : %s, \"no_prefetch\" : true, \"affine_to_cpu\" : %u },\n",
-				double_mode ? "true" : "false", aff_id);
-			printer::inst()->print_str(strbuf);
+			jconf::thd_cfg cfg;
+			cfg.iMultiway = double_mode ? 2 : 1;
+			cfg.bNoPrefetch = true;
+			cfg.iCpuAff = aff_id;
+			cfgs.push_back(cfg);
 
 			if(!linux_layout || old_amd)
 			{
@@ -86,7 +108,7 @@ public:
 				L3KB_size -= 2048;
 		}
 
-		printer::inst()->print_str("],\n\n**************** Copy&Paste END ****************\n");
+		return true;
 	}
 
 private:
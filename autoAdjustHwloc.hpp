@@ -1,8 +1,11 @@
 #pragma once
 
+#include "jconf.h"
 #include "console.h"
-#include <hwloc.h>
+#include "topology.h"
 #include <stdio.h>
+#include <stdexcept>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -25,17 +28,49 @@ public:
 		printer::inst()->print_str("The values are not optimal, please try to tweak the values based on notes in config.txt.\n");
 		printer::inst()->print_str("Please copy & paste the block within the asterisks to your config.\n\n");
 
-		hwloc_topology_t topology;
-		hwloc_topology_init(&topology);
-		hwloc_topology_load(topology);
+		std::vector<jconf::thd_cfg> cfgs;
+		if(getConfig(cfgs))
+		{
+			printer::inst()->print_str("\n**************** Copy&Paste BEGIN ****************\n\n");
+			printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
+
+			for(const jconf::thd_cfg& cfg : cfgs)
+			{
+				char str[128];
+				snprintf(str, sizeof(str), "    { \"low_power_mode\" : %s, \"no_prefetch\" : true, \"affine_to_cpu\" : %u },\n",
+					cfg.iMultiway == 2 ? "true" : "false", (uint32_t)cfg.iCpuAff);
+				printer::inst()->print_str(str);
+			}
+
+			printer::inst()->print_str("],\n\n**************** Copy&Paste END ****************\n");
+		}
+		else
+		{
+			printer::inst()->print_str("\nPrinting config for a single thread. Please try to add new ones until the hashrate slows down.\n");
+			printer::inst()->print_str("\n**************** FAILURE Copy&Paste BEGIN ****************\n\n");
+			printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
+			printer::inst()->print_str("    { \"low_power_mode\" : false, \"no_prefetch\" : true, \"affine_to_cpu\" : false },\n");
+			printer::inst()->print_str("],\n\n**************** FAILURE Copy&Paste END ****************\n");
+		}
+	}
 
+	// Cache size based thread config, returns false if the topology couldn't be evaluated
+	bool getConfig(std::vector<jconf::thd_cfg>& cfgs)
+	{
+		hwloc_topology_t topo = topology::inst()->get();
+
+		bool bOk = true;
 		try
 		{
+			if(topo == nullptr)
+				throw(std::runtime_error("hwloc failed to load the topology."));
+
 			std::vector<hwloc_obj_t> tlcs;
 			tlcs.reserve(16);
+			results.clear();
 			results.reserve(16);
 
-			findChildrenCaches(hwloc_get_root_obj(topology),
+			findChildrenCaches(hwloc_get_root_obj(topo),
 				[&tlcs](hwloc_obj_t found) { tlcs.emplace_back(found); } );
 
 			if(tlcs.size() == 0)
@@ -44,31 +79,23 @@ public:
 			for(hwloc_obj_t obj : tlcs)
 				proccessTopLevelCache(obj);
 
-			printer::inst()->print_str("\n**************** Copy&Paste BEGIN ****************\n\n");
-			printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
-
+			cfgs.clear();
 			for(uint32_t id : results)
 			{
-				char str[128];
-				snprintf(str, sizeof(str), "    { \"low_power_mode\" : %s, \"no_prefetch\" : true, \"affine_to_cpu\" : %u },\n",
-					(id & 0x8000000) != 0 ? "true" : "false", id & 0x7FFFFFF);
-				printer::inst()->print_str(str);
+				jconf::thd_cfg cfg;
+				cfg.iMultiway = (id & 0x8000000) != 0 ? 2 : 1;
+				cfg.bNoPrefetch = true;
+				cfg.iCpuAff = id & 0x7FFFFFF;
+				cfgs.push_back(cfg);
 			}
-
-			printer::inst()->print_str("],\n\n**************** Copy&Paste END ****************\n");
 		}
 		catch(const std::runtime_error& err)
 		{
 			printer::inst()->print_msg(L0, "Autoconf FAILED: %s", err.what());
-			printer::inst()->print_str("\nPrinting config for a single thread. Please try to add new ones until the hashrate slows down.\n");
-			printer::inst()->print_str("\n**************** FAILURE Copy&Paste BEGIN ****************\n\n");
-			printer::inst()->print_str("\"cpu_threads_conf\" :\n[\n");
-			printer::inst()->print_str("    { \"low_power_mode\" : false, \"no_prefetch\" : true, \"affine_to_cpu\" : false },\n");
-			printer::inst()->print_str("],\n\n**************** FAILURE Copy&Paste END ****************\n");
+			bOk = false;
 		}
 
-		/* Destroy topology object. */
-		hwloc_topology_destroy(topology);
+		return bOk;
 	}
 
 private:
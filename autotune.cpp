@@ -0,0 +1,380 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#include "autotune.h"
+#include "minethd.h"
+#include "console.h"
+#include "topology.h"
+#include "crypto/cryptonight_kernels.h"
+
+#ifndef CONF_NO_HWLOC
+#   include "autoAdjustHwloc.hpp"
+#else
+#   include "autoAdjust.hpp"
+#endif
+
+// Give the threads time to allocate their scratchpads before we start counting
+static constexpr size_t iWarmupSec = 3;
+
+void autotune::detectCores()
+{
+	vCores.clear();
+
+	topology::inst()->core_pus(vCores);
+
+	// Without hwloc we don't know the SMT siblings, treat every logical CPU as a core
+	if(vCores.empty())
+	{
+		uint32_t n = std::thread::hardware_concurrency();
+		for(uint32_t i = 0; i < (n == 0 ? 1 : n); i++)
+			vCores.push_back(std::vector<uint32_t>(1, i));
+	}
+}
+
+void autotune::makeLayout(std::vector<jconf::thd_cfg>& vCfg, bool bSmt, int iMultiway)
+{
+	vCfg.clear();
+
+	// Firstly PU 0 of every core, then PU 1 etc. - same order as autoAdjust
+	size_t iMaxPu = 1;
+	if(bSmt)
+	{
+		for(const std::vector<uint32_t>& pus : vCores)
+			iMaxPu = pus.size() > iMaxPu ? pus.size() : iMaxPu;
+	}
+
+	for(size_t pu = 0; pu < iMaxPu; pu++)
+	{
+		for(const std::vector<uint32_t>& pus : vCores)
+		{
+			if(pu >= pus.size())
+				continue;
+
+			jconf::thd_cfg cfg;
+			cfg.iMultiway = iMultiway;
+			cfg.bNoPrefetch = true;
+			cfg.iCpuAff = pus[pu];
+			vCfg.push_back(cfg);
+		}
+	}
+}
+
+double autotune::measure(const std::vector<jconf::thd_cfg>& vCfg)
+{
+	using namespace std::chrono;
+
+	uint8_t work[76] = {0};
+	// miner_work copies the whole 64 byte job ID
+	char sJobID[64] = {0};
+	minethd::miner_work oWork = minethd::miner_work(sJobID, work, sizeof(work), 0, 0, false, 0);
+	std::vector<minethd*>* pvThreads = minethd::thread_starter(oWork, vCfg);
+	size_t n = pvThreads->size();
+
+	std::this_thread::sleep_for(seconds(iWarmupSec));
+
+	std::vector<uint64_t> vCount(n), vStamp(n);
+	for(size_t i = 0; i < n; i++)
+	{
+		vCount[i] = pvThreads->at(i)->iHashCount.load(std::memory_order_relaxed);
+		vStamp[i] = pvThreads->at(i)->iTimestamp.load(std::memory_order_relaxed);
+	}
+
+	std::this_thread::sleep_for(seconds(iMeasureSec));
+
+	// Every thread is measured over its own stat updates, so the update interval doesn't skew the result
+	double fTotalHps = 0.0;
+	for(size_t i = 0; i < n; i++)
+	{
+		uint64_t iCount = pvThreads->at(i)->iHashCount.load(std::memory_order_relaxed);
+		uint64_t iStamp = pvThreads->at(i)->iTimestamp.load(std::memory_order_relaxed);
+
+		if(iStamp > vStamp[i])
+			fTotalHps += double(iCount - vCount[i]) / ((iStamp - vStamp[i]) / 1000.0);
+	}
+
+	minethd::thread_stopper(pvThreads);
+	return fTotalHps;
+}
+
+bool autotune::tryCandidate(candidate& c)
+{
+	c.fHps = measure(c.vCfg);
+	printer::inst()->print_msg(L0, "Autotune: %-56s %8.1f H/s", c.sName.c_str(), c.fHps);
+
+	if(c.fHps <= oBest.fHps)
+		return false;
+
+	oBest = c;
+	return true;
+}
+
+bool autotune::run(const char* sConfigFile)
+{
+	char buffer[128];
+	candidate c;
+
+	detectCores();
+
+	bool bHaveSmt = false;
+	for(const std::vector<uint32_t>& pus : vCores)
+		bHaveSmt |= pus.size() > 1;
+
+	printer::inst()->print_msg(L0, "Autotune: %llu cores%s, measuring every candidate for %llu seconds.",
+		int_port(vCores.size()), bHaveSmt ? " with SMT" : "", int_port(iMeasureSec));
+
+	oBest.fHps = 0.0;
+
+	autoAdjust adjust;
+	if(adjust.getConfig(c.vCfg) && !c.vCfg.empty())
+	{
+		c.sName = "cache size heuristic";
+		tryCandidate(c);
+	}
+
+	for(size_t layout = 0; layout < (bHaveSmt ? 2 : 1); layout++)
+	{
+		bool bSmt = layout == 1;
+		double fLayoutBest = 0.0;
+
+		for(int iMultiway = 1; iMultiway <= (int)CN_MAX_N; iMultiway++)
+		{
+			makeLayout(c.vCfg, bSmt, iMultiway);
+			snprintf(buffer, sizeof(buffer), "%llu threads on %s, low_power_mode %d",
+				int_port(c.vCfg.size()), bSmt ? "all PUs" : "one PU per core", iMultiway);
+			c.sName = buffer;
+			tryCandidate(c);
+
+			// Once the scratchpads don't fit into the cache any more it only gets worse
+			if(c.fHps > fLayoutBest)
+				fLayoutBest = c.fHps;
+			else if(c.fHps < fLayoutBest * 0.97)
+				break;
+		}
+	}
+
+	if(oBest.vCfg.empty())
+	{
+		printer::inst()->print_msg(L0, "Autotune failed: no configuration produced any hashes.");
+		return false;
+	}
+
+	c = oBest;
+	for(jconf::thd_cfg& cfg : c.vCfg)
+		cfg.bNoPrefetch = false;
+	c.sName = oBest.sName + ", prefetch";
+	tryCandidate(c);
+
+	c = oBest;
+	for(jconf::thd_cfg& cfg : c.vCfg)
+		cfg.iCpuAff = -1;
+	c.sName = oBest.sName + ", no affinity";
+	tryCandidate(c);
+
+	printer::inst()->print_msg(L0, "Autotune: best is %s with %.1f H/s.", oBest.sName.c_str(), oBest.fHps);
+
+	if(!writeConfig(sConfigFile, oBest.vCfg))
+		return false;
+
+	printer::inst()->print_msg(L0, "Autotune: cpu_threads_conf written to %s.", sConfigFile);
+	return true;
+}
+
+namespace
+{
+// Minimal scanner for the config format - JSON with comments
+struct conf_scanner
+{
+	const std::string& s;
+	size_t pos;
+
+	conf_scanner(const std::string& str) : s(str), pos(0) {}
+
+	// Skips whitespace and comments, returns false at the end of the file
+	bool skip_blank()
+	{
+		while(pos < s.size())
+		{
+			if(isspace((unsigned char)s[pos]))
+				pos++;
+			else if(s.compare(pos, 2, "//") == 0)
+			{
+				pos = s.find('\n', pos);
+				if(pos == std::string::npos)
+					pos = s.size();
+			}
+			else if(s.compare(pos, 2, "/*") == 0)
+			{
+				pos = s.find("*/", pos + 2);
+				pos = pos == std::string::npos ? s.size() : pos + 2;
+			}
+			else
+				return true;
+		}
+		return false;
+	}
+
+	// pos has to be on the opening quote, leaves pos after the closing one
+	std::string read_string()
+	{
+		std::string out;
+		for(pos++; pos < s.size() && s[pos] != '"'; pos++)
+		{
+			if(s[pos] == '\\')
+				pos++;
+			if(pos < s.size())
+				out.push_back(s[pos]);
+		}
+		pos++;
+		return out;
+	}
+
+	// Skips over one value (string, literal, object or array)
+	void skip_value()
+	{
+		int depth = 0;
+		while(skip_blank())
+		{
+			char c = s[pos];
+			if(c == '"')
+				read_string();
+			else if(c == '[' || c == '{')
+			{
+				depth++;
+				pos++;
+			}
+			else if(c == ']' || c == '}')
+			{
+				if(depth == 0)
+					return;
+				pos++;
+				if(--depth == 0)
+					return;
+			}
+			else if(c == ',' && depth == 0)
+				return;
+			else
+				pos++;
+		}
+	}
+};
+}
+
+bool autotune::writeConfig(const char* sConfigFile, const std::vector<jconf::thd_cfg>& vCfg)
+{
+	FILE* f = fopen(sConfigFile, "rb");
+	if(f == nullptr)
+	{
+		printer::inst()->print_msg(L0, "Autotune: failed to open %s.", sConfigFile);
+		return false;
+	}
+
+	std::string sConf;
+	char buffer[4096];
+	size_t len;
+	while((len = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		sConf.append(buffer, len);
+	fclose(f);
+
+	conf_scanner scan(sConf);
+	size_t iValStart = std::string::npos, iValEnd = std::string::npos;
+	while(scan.skip_blank())
+	{
+		if(sConf[scan.pos] != '"')
+		{
+			scan.pos++;
+			continue;
+		}
+
+		std::string key = scan.read_string();
+		if(!scan.skip_blank() || sConf[scan.pos] != ':')
+			continue;
+		scan.pos++;
+
+		if(key == "cpu_threads_conf")
+		{
+			iValStart = scan.pos;
+			scan.skip_value();
+			iValEnd = scan.pos;
+			break;
+		}
+	}
+
+	if(iValStart == std::string::npos)
+	{
+		printer::inst()->print_msg(L0, "Autotune: cpu_threads_conf not found in %s.", sConfigFile);
+		return false;
+	}
+
+	std::string sThreads = "\n[\n";
+	for(const jconf::thd_cfg& cfg : vCfg)
+	{
+		char sMode[16], sAff[16];
+		if(cfg.iMultiway <= 2)
+			snprintf(sMode, sizeof(sMode), "%s", cfg.iMultiway == 2 ? "true" : "false");
+		else
+			snprintf(sMode, sizeof(sMode), "%d", cfg.iMultiway);
+
+		if(cfg.iCpuAff >= 0)
+			snprintf(sAff, sizeof(sAff), "%llu", int_port(cfg.iCpuAff));
+		else
+			snprintf(sAff, sizeof(sAff), "false");
+
+		snprintf(buffer, sizeof(buffer), "    { \"low_power_mode\" : %s, \"no_prefetch\" : %s, \"affine_to_cpu\" : %s },\n",
+			sMode, cfg.bNoPrefetch ? "true" : "false", sAff);
+		sThreads.append(buffer);
+	}
+	sThreads.append("]");
+
+	// Keep whatever follows the value (the comma) as it was
+	sConf.replace(iValStart, iValEnd - iValStart, sThreads);
+
+	std::string sTmpFile = std::string(sConfigFile) + ".tmp";
+	f = fopen(sTmpFile.c_str(), "wb");
+	if(f == nullptr || fwrite(sConf.data(), 1, sConf.size(), f) != sConf.size())
+	{
+		if(f != nullptr)
+			fclose(f);
+		printer::inst()->print_msg(L0, "Autotune: failed to write %s.", sTmpFile.c_str());
+		return false;
+	}
+	fclose(f);
+
+#ifdef _WIN32
+	remove(sConfigFile);
+#endif
+	if(rename(sTmpFile.c_str(), sConfigFile) != 0)
+	{
+		printer::inst()->print_msg(L0, "Autotune: failed to replace %s, the result is in %s.", sConfigFile, sTmpFile.c_str());
+		return false;
+	}
+
+	return true;
+}
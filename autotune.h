@@ -0,0 +1,40 @@
+#pragma once
+#include "jconf.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Search for the best cpu_threads_conf by measuring it
+ *
+ * Every candidate configuration is started with real mining threads on a dummy job
+ * and its hashrate is measured. The candidates are the cache size heuristic from
+ * autoAdjust plus uniform configs over all cores and over all SMT siblings with
+ * increasing low_power_mode, then prefetch and affinity are varied on the best one.
+ * The winner is written back to the config file.
+ */
+class autotune
+{
+public:
+	autotune(size_t iSeconds) : iMeasureSec(iSeconds) {}
+
+	bool run(const char* sConfigFile);
+
+private:
+	struct candidate
+	{
+		std::vector<jconf::thd_cfg> vCfg;
+		std::string sName;
+		double fHps;
+	};
+
+	void detectCores();
+	void makeLayout(std::vector<jconf::thd_cfg>& vCfg, bool bSmt, int iMultiway);
+	bool tryCandidate(candidate& c);
+	double measure(const std::vector<jconf::thd_cfg>& vCfg);
+	bool writeConfig(const char* sConfigFile, const std::vector<jconf::thd_cfg>& vCfg);
+
+	size_t iMeasureSec;
+	// OS index of every PU, grouped by physical core
+	std::vector<std::vector<uint32_t>> vCores;
+	candidate oBest;
+};
@@ -32,6 +32,9 @@
 #   include "autoAdjust.hpp"
 #endif
 #include "version.h"
+#include "kernel_bench.h"
+#include "autotune.h"
+#include "ctx_arena.h"
 
 #ifndef CONF_NO_HTTPD
 #	include "httpd.h"
@@ -80,12 +83,18 @@ int main(int argc, char *argv[])
 
 	const char* sFilename = "config.txt";
 	bool benchmark_mode = false;
+	bool bench_kernels_mode = false;
+	const char* sBenchOut = nullptr;
+	bool autotune_mode = false;
+	size_t iAutotuneSec = 10;
 
 	if(argc >= 2)
 	{
 		if(strcmp(argv[1], "-h") == 0)
 		{
 			printer::inst()->print_msg(L0, "Usage %s [CONFIG FILE]", argv[0]);
+			printer::inst()->print_msg(L0, "      %s --bench-kernels CONFIG_FILE [JSON OUTPUT FILE]", argv[0]);
+			printer::inst()->print_msg(L0, "      %s --autotune CONFIG_FILE [SECONDS PER CANDIDATE]", argv[0]);
 			win_exit();
 			return 0;
 		}
@@ -99,6 +108,19 @@ int main(int argc, char *argv[])
 			sFilename = argv[2];
 			benchmark_mode = true;
 		}
+		else if(argc >= 3 && strcasecmp(argv[1], "--bench-kernels") == 0)
+		{
+			sFilename = argv[2];
+			sBenchOut = argc >= 4 ? argv[3] : nullptr;
+			bench_kernels_mode = true;
+		}
+		else if(argc >= 3 && strcasecmp(argv[1], "--autotune") == 0)
+		{
+			sFilename = argv[2];
+			if(argc >= 4 && atoi(argv[3]) > 0)
+				iAutotuneSec = atoi(argv[3]);
+			autotune_mode = true;
+		}
 		else
 			sFilename = argv[1];
 	}
@@ -109,6 +131,23 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	// Kernel benchmark and autotune don't need the thread config, so they can run before autoconf
+	if(bench_kernels_mode)
+	{
+		if(minethd::self_test())
+			bench_kernels(sBenchOut);
+		win_exit();
+		return 0;
+	}
+
+	if(autotune_mode)
+	{
+		if(minethd::self_test())
+			autotune(iAutotuneSec).run(sFilename);
+		win_exit();
+		return 0;
+	}
+
 	if(jconf::inst()->NeedsAutoconf())
 	{
 		autoAdjust adjust;
@@ -117,6 +156,12 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (!ctx_arena::inst()->plan())
+	{
+		win_exit();
+		return 0;
+	}
+
 	if (!minethd::self_test())
 	{
 		win_exit();
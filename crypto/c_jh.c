@@ -213,16 +213,19 @@ static void E8(hashState *state)
 /*The compression function F8 */
 static void F8(hashState *state)
 {
-	  uint64  i;
+	  uint64  i, m[8];
+
+	  /*reading the byte buffer through a uint64 pointer breaks strict aliasing, GCC 12 gets the hash wrong in release builds*/
+	  memcpy(m, state->buffer, 64);
 
 	  /*xor the 512-bit message with the fist half of the 1024-bit hash state*/
-	  for (i = 0; i < 8; i++)  state->x[i >> 1][i & 1] ^= ((uint64*)state->buffer)[i];
+	  for (i = 0; i < 8; i++)  state->x[i >> 1][i & 1] ^= m[i];
 
 	  /*the bijective function E8 */
 	  E8(state);
 
 	  /*xor the 512-bit message with the second half of the 1024-bit hash state*/
-	  for (i = 0; i < 8; i++)  state->x[(8+i) >> 1][(8+i) & 1] ^= ((uint64*)state->buffer)[i];
+	  for (i = 0; i < 8; i++)  state->x[(8+i) >> 1][(8+i) & 1] ^= m[i];
 }
 
 /*before hashing a message, initialize the hash state as H0 */
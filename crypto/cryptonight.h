@@ -13,9 +13,41 @@ extern "C" {
 typedef struct {
 	uint8_t hash_state[224]; // Need only 200, explicit align
 	uint8_t* long_state;
-	uint8_t ctx_info[24]; //Use some of the extra memory for flags
+	// Use some of the extra memory for flags: [0] large pages, [1] locked, [2] owned by the
+	// scratchpad arena, [3] NUMA node + 1 (0 unknown), [4] arena pool, [5] page size (CTX_PAGES_*)
+	uint8_t ctx_info[24];
+	// Cancellation points, nullptr unless a mining thread set them. The hash gives up between
+	// its phases and every few thousand main loop rounds once the std::atomic<uint64_t> that
+	// cancel_epoch points to no longer holds epoch, and sets cancelled. Multiway hashes only
+	// look at the first context.
+	const void* cancel_epoch;
+	uint64_t epoch;
+	uint8_t cancelled;
+	// a, b and c of the main loop, kept between calls of the pipelined kernels
+	uint8_t pipe_state[48];
 } cryptonight_ctx;
 
+// Pages the scratchpad ended up on, from worst to best
+#define CTX_PAGES_NORMAL 0
+#define CTX_PAGES_THP    1
+#define CTX_PAGES_2MB    2
+#define CTX_PAGES_1GB    3
+
+static inline const char* cryptonight_page_name(uint8_t pages)
+{
+	switch(pages)
+	{
+	case CTX_PAGES_THP:
+		return "THP";
+	case CTX_PAGES_2MB:
+		return "2MB";
+	case CTX_PAGES_1GB:
+		return "1GB";
+	default:
+		return "4KB";
+	}
+}
+
 typedef struct {
 	const char* warning;
 } alloc_msg;
@@ -23,6 +55,8 @@ typedef struct {
 size_t cryptonight_init(size_t use_fast_mem, size_t use_mlock, alloc_msg* msg);
 cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, alloc_msg* msg);
 void cryptonight_free_ctx(cryptonight_ctx* ctx);
+// Bytes of the mapping holding mem that are backed by transparent huge pages (AnonHugePages in smaps)
+size_t cryptonight_thp_bytes(const void* mem);
 
 #ifdef __cplusplus
 }
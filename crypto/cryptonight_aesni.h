@@ -16,8 +16,10 @@
 #pragma once
 
 #include "cryptonight.h"
+#include "cryptonight_kernels.h"
 #include <memory.h>
 #include <stdio.h>
+#include <atomic>
 
 #ifdef __GNUC__
 #include <x86intrin.h>
@@ -36,16 +38,27 @@ static inline uint64_t _umul128(uint64_t a, uint64_t b, uint64_t* hi)
 #error You are trying to do a 32-bit build. This will all end in tears. I know it.
 #endif
 
+// The kernel translation units (cryptonight_kernels_*.cpp) are each built with their own ISA flags
+// and may set CN_KERNEL_VAES or CN_KERNEL_AVX512 before including this file to get the wide AES
+// explode and implode. Everything below the C declarations lives in an anonymous namespace, so the
+// instantiations of one translation unit can never be merged by the linker with those of another.
+
 extern "C"
 {
 	void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
 	void keccakf(uint64_t st[25], int rounds);
+	extern const uint64_t keccakf_rndc[24];
 	extern void(*const extra_hashes[4])(const void *, size_t, char *);
 
 	__m128i soft_aesenc(__m128i in, __m128i key);
 	__m128i soft_aeskeygenassist(__m128i key, uint8_t rcon);
 }
 
+#include "cryptonight_finalizers.h"
+
+namespace
+{
+
 // This will shift and xor tmp1 into itself as 4 32-bit vals such as
 // sl_xor(a1 a2 a3 a4) = a1 (a2^a1) (a3^a2^a1) (a4^a3^a2^a1)
 static inline __m128i sl_xor(__m128i tmp1)
@@ -149,9 +162,246 @@ static inline void soft_aes_round(__m128i key, __m128i* x0, __m128i* x1, __m128i
 	*x7 = soft_aesenc(*x7, key);
 }
 
+#ifdef CN_KERNEL_VAES
+static inline void vaes_round(__m256i key, __m256i* x01, __m256i* x23, __m256i* x45, __m256i* x67)
+{
+	*x01 = _mm256_aesenc_epi128(*x01, key);
+	*x23 = _mm256_aesenc_epi128(*x23, key);
+	*x45 = _mm256_aesenc_epi128(*x45, key);
+	*x67 = _mm256_aesenc_epi128(*x67, key);
+}
+
+// Same as cn_explode_scratchpad, but we process two 128-bit lanes per AES instruction. The lane order
+// in memory is unchanged - low half of xin01 is xin0, high half is xin1.
+template<size_t MEM, bool PREFETCH>
+void cn_explode_scratchpad_vaes(const __m128i* input, __m128i* output)
+{
+	__m256i xin01, xin23, xin45, xin67;
+	__m256i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9;
+
+	aes_genkey<false>(input, &x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7, &x8, &x9);
+
+	k0 = _mm256_broadcastsi128_si256(x0);
+	k1 = _mm256_broadcastsi128_si256(x1);
+	k2 = _mm256_broadcastsi128_si256(x2);
+	k3 = _mm256_broadcastsi128_si256(x3);
+	k4 = _mm256_broadcastsi128_si256(x4);
+	k5 = _mm256_broadcastsi128_si256(x5);
+	k6 = _mm256_broadcastsi128_si256(x6);
+	k7 = _mm256_broadcastsi128_si256(x7);
+	k8 = _mm256_broadcastsi128_si256(x8);
+	k9 = _mm256_broadcastsi128_si256(x9);
+
+	xin01 = _mm256_loadu_si256((const __m256i*)(input + 4));
+	xin23 = _mm256_loadu_si256((const __m256i*)(input + 6));
+	xin45 = _mm256_loadu_si256((const __m256i*)(input + 8));
+	xin67 = _mm256_loadu_si256((const __m256i*)(input + 10));
+
+	for (size_t i = 0; i < MEM / sizeof(__m128i); i += 8)
+	{
+		vaes_round(k0, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k1, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k2, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k3, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k4, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k5, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k6, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k7, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k8, &xin01, &xin23, &xin45, &xin67);
+		vaes_round(k9, &xin01, &xin23, &xin45, &xin67);
+
+		_mm256_store_si256((__m256i*)(output + i + 0), xin01);
+		_mm256_store_si256((__m256i*)(output + i + 2), xin23);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)output + i + 0, _MM_HINT_T2);
+
+		_mm256_store_si256((__m256i*)(output + i + 4), xin45);
+		_mm256_store_si256((__m256i*)(output + i + 6), xin67);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)output + i + 4, _MM_HINT_T2);
+	}
+}
+
+template<size_t MEM, bool PREFETCH>
+void cn_implode_scratchpad_vaes(const __m128i* input, __m128i* output)
+{
+	__m256i xout01, xout23, xout45, xout67;
+	__m256i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9;
+
+	aes_genkey<false>(output + 2, &x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7, &x8, &x9);
+
+	k0 = _mm256_broadcastsi128_si256(x0);
+	k1 = _mm256_broadcastsi128_si256(x1);
+	k2 = _mm256_broadcastsi128_si256(x2);
+	k3 = _mm256_broadcastsi128_si256(x3);
+	k4 = _mm256_broadcastsi128_si256(x4);
+	k5 = _mm256_broadcastsi128_si256(x5);
+	k6 = _mm256_broadcastsi128_si256(x6);
+	k7 = _mm256_broadcastsi128_si256(x7);
+	k8 = _mm256_broadcastsi128_si256(x8);
+	k9 = _mm256_broadcastsi128_si256(x9);
+
+	xout01 = _mm256_loadu_si256((const __m256i*)(output + 4));
+	xout23 = _mm256_loadu_si256((const __m256i*)(output + 6));
+	xout45 = _mm256_loadu_si256((const __m256i*)(output + 8));
+	xout67 = _mm256_loadu_si256((const __m256i*)(output + 10));
+
+	for (size_t i = 0; i < MEM / sizeof(__m128i); i += 8)
+	{
+		if(PREFETCH)
+			_mm_prefetch((const char*)input + i + 0, _MM_HINT_NTA);
+
+		xout01 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(input + i + 0)), xout01);
+		xout23 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(input + i + 2)), xout23);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)input + i + 4, _MM_HINT_NTA);
+
+		xout45 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(input + i + 4)), xout45);
+		xout67 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(input + i + 6)), xout67);
+
+		vaes_round(k0, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k1, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k2, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k3, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k4, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k5, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k6, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k7, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k8, &xout01, &xout23, &xout45, &xout67);
+		vaes_round(k9, &xout01, &xout23, &xout45, &xout67);
+	}
+
+	_mm256_storeu_si256((__m256i*)(output + 4), xout01);
+	_mm256_storeu_si256((__m256i*)(output + 6), xout23);
+	_mm256_storeu_si256((__m256i*)(output + 8), xout45);
+	_mm256_storeu_si256((__m256i*)(output + 10), xout67);
+}
+#endif // CN_KERNEL_VAES
+
+#ifdef CN_KERNEL_AVX512
+static inline void avx512_round(__m512i key, __m512i* x0123, __m512i* x4567)
+{
+	*x0123 = _mm512_aesenc_epi128(*x0123, key);
+	*x4567 = _mm512_aesenc_epi128(*x4567, key);
+}
+
+// The whole 128 byte block fits in two zmm registers, lane order in memory is unchanged
+template<size_t MEM, bool PREFETCH>
+void cn_explode_scratchpad_avx512(const __m128i* input, __m128i* output)
+{
+	__m512i xin0123, xin4567;
+	__m512i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9;
+
+	aes_genkey<false>(input, &x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7, &x8, &x9);
+
+	k0 = _mm512_broadcast_i32x4(x0);
+	k1 = _mm512_broadcast_i32x4(x1);
+	k2 = _mm512_broadcast_i32x4(x2);
+	k3 = _mm512_broadcast_i32x4(x3);
+	k4 = _mm512_broadcast_i32x4(x4);
+	k5 = _mm512_broadcast_i32x4(x5);
+	k6 = _mm512_broadcast_i32x4(x6);
+	k7 = _mm512_broadcast_i32x4(x7);
+	k8 = _mm512_broadcast_i32x4(x8);
+	k9 = _mm512_broadcast_i32x4(x9);
+
+	xin0123 = _mm512_loadu_si512((const void*)(input + 4));
+	xin4567 = _mm512_loadu_si512((const void*)(input + 8));
+
+	for (size_t i = 0; i < MEM / sizeof(__m128i); i += 8)
+	{
+		avx512_round(k0, &xin0123, &xin4567);
+		avx512_round(k1, &xin0123, &xin4567);
+		avx512_round(k2, &xin0123, &xin4567);
+		avx512_round(k3, &xin0123, &xin4567);
+		avx512_round(k4, &xin0123, &xin4567);
+		avx512_round(k5, &xin0123, &xin4567);
+		avx512_round(k6, &xin0123, &xin4567);
+		avx512_round(k7, &xin0123, &xin4567);
+		avx512_round(k8, &xin0123, &xin4567);
+		avx512_round(k9, &xin0123, &xin4567);
+
+		_mm512_store_si512((void*)(output + i + 0), xin0123);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)output + i + 0, _MM_HINT_T2);
+
+		_mm512_store_si512((void*)(output + i + 4), xin4567);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)output + i + 4, _MM_HINT_T2);
+	}
+}
+
+template<size_t MEM, bool PREFETCH>
+void cn_implode_scratchpad_avx512(const __m128i* input, __m128i* output)
+{
+	__m512i xout0123, xout4567;
+	__m512i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9;
+
+	aes_genkey<false>(output + 2, &x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7, &x8, &x9);
+
+	k0 = _mm512_broadcast_i32x4(x0);
+	k1 = _mm512_broadcast_i32x4(x1);
+	k2 = _mm512_broadcast_i32x4(x2);
+	k3 = _mm512_broadcast_i32x4(x3);
+	k4 = _mm512_broadcast_i32x4(x4);
+	k5 = _mm512_broadcast_i32x4(x5);
+	k6 = _mm512_broadcast_i32x4(x6);
+	k7 = _mm512_broadcast_i32x4(x7);
+	k8 = _mm512_broadcast_i32x4(x8);
+	k9 = _mm512_broadcast_i32x4(x9);
+
+	xout0123 = _mm512_loadu_si512((const void*)(output + 4));
+	xout4567 = _mm512_loadu_si512((const void*)(output + 8));
+
+	for (size_t i = 0; i < MEM / sizeof(__m128i); i += 8)
+	{
+		if(PREFETCH)
+			_mm_prefetch((const char*)input + i + 0, _MM_HINT_NTA);
+
+		xout0123 = _mm512_xor_si512(_mm512_load_si512((const void*)(input + i + 0)), xout0123);
+
+		if(PREFETCH)
+			_mm_prefetch((const char*)input + i + 4, _MM_HINT_NTA);
+
+		xout4567 = _mm512_xor_si512(_mm512_load_si512((const void*)(input + i + 4)), xout4567);
+
+		avx512_round(k0, &xout0123, &xout4567);
+		avx512_round(k1, &xout0123, &xout4567);
+		avx512_round(k2, &xout0123, &xout4567);
+		avx512_round(k3, &xout0123, &xout4567);
+		avx512_round(k4, &xout0123, &xout4567);
+		avx512_round(k5, &xout0123, &xout4567);
+		avx512_round(k6, &xout0123, &xout4567);
+		avx512_round(k7, &xout0123, &xout4567);
+		avx512_round(k8, &xout0123, &xout4567);
+		avx512_round(k9, &xout0123, &xout4567);
+	}
+
+	_mm512_storeu_si512((void*)(output + 4), xout0123);
+	_mm512_storeu_si512((void*)(output + 8), xout4567);
+}
+#endif // CN_KERNEL_AVX512
+
 template<size_t MEM, bool SOFT_AES, bool PREFETCH>
 void cn_explode_scratchpad(const __m128i* input, __m128i* output)
 {
+#if defined(CN_KERNEL_AVX512)
+	if(!SOFT_AES)
+		return cn_explode_scratchpad_avx512<MEM, PREFETCH>(input, output);
+#elif defined(CN_KERNEL_VAES)
+	if(!SOFT_AES)
+		return cn_explode_scratchpad_vaes<MEM, PREFETCH>(input, output);
+#endif
+
 	// This is more than we have registers, compiler will assign 2 keys on the stack
 	__m128i xin0, xin1, xin2, xin3, xin4, xin5, xin6, xin7;
 	__m128i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
@@ -217,6 +467,14 @@ void cn_explode_scratchpad(const __m128i* input, __m128i* output)
 template<size_t MEM, bool SOFT_AES, bool PREFETCH>
 void cn_implode_scratchpad(const __m128i* input, __m128i* output)
 {
+#if defined(CN_KERNEL_AVX512)
+	if(!SOFT_AES)
+		return cn_implode_scratchpad_avx512<MEM, PREFETCH>(input, output);
+#elif defined(CN_KERNEL_VAES)
+	if(!SOFT_AES)
+		return cn_implode_scratchpad_vaes<MEM, PREFETCH>(input, output);
+#endif
+
 	// This is more than we have registers, compiler will assign 2 keys on the stack
 	__m128i xout0, xout1, xout2, xout3, xout4, xout5, xout6, xout7;
 	__m128i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9;
@@ -288,394 +546,688 @@ void cn_implode_scratchpad(const __m128i* input, __m128i* output)
 	_mm_store_si128(output + 11, xout7);
 }
 
-#define CN_STEP1(a, b, c, l, ptr, idx)			\
-	a = _mm_xor_si128(a, c);			\
-	idx = _mm_cvtsi128_si64(a);			\
-	ptr = (__m128i *)&l[idx & 0x1FFFF0];		\
-	if(PREFETCH)					\
-		_mm_prefetch(ptr, _MM_HINT_T0);		\
-	c = _mm_load_si128(ptr)
-
-#define CN_STEP2(a, b, c, l, ptr, idx)			\
-	if(SOFT_AES)					\
-		c = soft_aesenc(c, a);			\
-	else						\
-		c = _mm_aesenc_si128(c, a);		\
-	b = _mm_xor_si128(b, c);			\
-	_mm_store_si128(ptr, b)
-
-#define CN_STEP3(a, b, c, l, ptr, idx)			\
-	idx = _mm_cvtsi128_si64(c);			\
-	ptr = (__m128i *)&l[idx & 0x1FFFF0];		\
-	if(PREFETCH)					\
-		_mm_prefetch(ptr, _MM_HINT_T0);		\
-	b = _mm_load_si128(ptr)
-
-#define CN_STEP4(a, b, c, l, ptr, idx)			\
-	lo = _umul128(idx, _mm_cvtsi128_si64(b), &hi);	\
-	a = _mm_add_epi64(a, _mm_set_epi64x(lo, hi));	\
-	_mm_store_si128(ptr, a)
+// One cryptonight round is split in four steps so the multiway kernels can interleave the
+// lanes between them. On even rounds b and c are passed as is, on odd rounds they are swapped.
+template<bool PREFETCH>
+static inline void cn_step1(__m128i& a, __m128i& c, uint8_t* l, __m128i*& ptr, uint64_t& idx)
+{
+	a = _mm_xor_si128(a, c);
+	idx = _mm_cvtsi128_si64(a);
+	ptr = (__m128i *)&l[idx & 0x1FFFF0];
+	if(PREFETCH)
+		_mm_prefetch((const char*)ptr, _MM_HINT_T0);
+	c = _mm_load_si128(ptr);
+}
 
-template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
-void cryptonight_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+template<bool SOFT_AES>
+static inline void cn_step2(__m128i& a, __m128i& b, __m128i& c, __m128i* ptr)
 {
-	keccak((const uint8_t *)input, len, ctx[0]->hash_state, 200);
+	if(SOFT_AES)
+		c = soft_aesenc(c, a);
+	else
+		c = _mm_aesenc_si128(c, a);
+	b = _mm_xor_si128(b, c);
+	_mm_store_si128(ptr, b);
+}
 
-	// Optim - 99% time boundary
-	cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[0]->hash_state, (__m128i*)ctx[0]->long_state);
+template<bool PREFETCH>
+static inline void cn_step3(__m128i& b, __m128i& c, uint8_t* l, __m128i*& ptr, uint64_t& idx)
+{
+	idx = _mm_cvtsi128_si64(c);
+	ptr = (__m128i *)&l[idx & 0x1FFFF0];
+	if(PREFETCH)
+		_mm_prefetch((const char*)ptr, _MM_HINT_T0);
+	b = _mm_load_si128(ptr);
+}
+
+static inline void cn_step4(__m128i& a, __m128i& b, __m128i* ptr, uint64_t idx)
+{
+	uint64_t hi, lo;
+	lo = _umul128(idx, _mm_cvtsi128_si64(b), &hi);
+	a = _mm_add_epi64(a, _mm_set_epi64x(lo, hi));
+	_mm_store_si128(ptr, a);
+}
+
+// Main loop rounds between two cancellation points, about 1/64 of a hash
+constexpr size_t CN_CANCEL_ROUNDS = 0x2000;
+
+// Cancellation point, see cryptonight_ctx::cancel_epoch
+static inline bool cn_cancelled(cryptonight_ctx* ctx)
+{
+	if(ctx->cancel_epoch == nullptr)
+		return false;
 
-	uint8_t* l0 = ctx[0]->long_state;
-	uint64_t* h0 = (uint64_t*)ctx[0]->hash_state;
+	if(((const std::atomic<uint64_t>*)ctx->cancel_epoch)->load(std::memory_order_relaxed) == ctx->epoch)
+		return false;
+
+	ctx->cancelled = 1;
+	return true;
+}
+
+template<size_t ITERATIONS, bool SOFT_AES, bool PREFETCH>
+static inline bool cn_main_loop(cryptonight_ctx* ctx, cryptonight_ctx* cancel_ctx)
+{
+	uint8_t* l0 = ctx->long_state;
+	uint64_t* h0 = (uint64_t*)ctx->hash_state;
 
 	__m128i ax = _mm_set_epi64x(h0[1] ^ h0[5], h0[0] ^ h0[4]);
 	__m128i bx = _mm_set_epi64x(h0[3] ^ h0[7], h0[2] ^ h0[6]);
 	__m128i cx = _mm_set_epi64x(0, 0);
 
-	// Optim - 90% time boundary
-	for (size_t i = 0; i < ITERATIONS/2; i++)
+	static_assert(ITERATIONS % CN_CANCEL_ROUNDS == 0, "ITERATIONS has to be a multiple of CN_CANCEL_ROUNDS");
+	for (size_t j = 0; j < ITERATIONS; j += CN_CANCEL_ROUNDS)
+	{
+		for (size_t i = 0; i < CN_CANCEL_ROUNDS/2; i++)
+		{
+			uint64_t idx;
+			__m128i *ptr;
+
+			// EVEN ROUND
+			cn_step1<PREFETCH>(ax, cx, l0, ptr, idx);
+			cn_step2<SOFT_AES>(ax, bx, cx, ptr);
+			cn_step3<PREFETCH>(bx, cx, l0, ptr, idx);
+			cn_step4(ax, bx, ptr, idx);
+
+			// ODD ROUND
+			cn_step1<PREFETCH>(ax, bx, l0, ptr, idx);
+			cn_step2<SOFT_AES>(ax, cx, bx, ptr);
+			cn_step3<PREFETCH>(cx, bx, l0, ptr, idx);
+			cn_step4(ax, cx, ptr, idx);
+		}
+
+		if(cn_cancelled(cancel_ctx))
+			return false;
+	}
+	return true;
+}
+
+// Same as extra_hashes[state[0] & 3] with the versions from cryptonight_finalizers.h. Groestl
+// without AES-NI stays with the C code.
+template<bool SOFT_AES>
+static inline void cn_extra_hash(const void* state, size_t len, char* output)
+{
+	switch(*(const uint8_t*)state & 3)
 	{
-		uint64_t idx, hi, lo;
-		__m128i *ptr;
-
-		// EVEN ROUND
-		CN_STEP1(ax, bx, cx, l0, ptr, idx);
-		CN_STEP2(ax, bx, cx, l0, ptr, idx);
-		CN_STEP3(ax, bx, cx, l0, ptr, idx);
-		CN_STEP4(ax, bx, cx, l0, ptr, idx);
-
-		// ODD ROUND
-		CN_STEP1(ax, cx, bx, l0, ptr, idx);
-		CN_STEP2(ax, cx, bx, l0, ptr, idx);
-		CN_STEP3(ax, cx, bx, l0, ptr, idx);
-		CN_STEP4(ax, cx, bx, l0, ptr, idx);
+	case 0:
+		cn_blake256(state, len, output);
+		break;
+	case 1:
+#if defined(__AES__) || defined(_MSC_VER)
+		if(!SOFT_AES)
+		{
+			cn_groestl256(state, len, output);
+			break;
+		}
+#endif
+		extra_hashes[1](state, len, output);
+		break;
+	case 2:
+		cn_jh256(state, len, output);
+		break;
+	default:
+		cn_skein512_256(state, len, output);
+		break;
 	}
+}
+
+template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
+void cryptonight_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+{
+	keccak((const uint8_t *)input, len, ctx[0]->hash_state, 200);
+
+	// Optim - 99% time boundary
+	cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[0]->hash_state, (__m128i*)ctx[0]->long_state);
+	if(cn_cancelled(ctx[0]))
+		return;
+
+	// Optim - 90% time boundary
+	if(!cn_main_loop<ITERATIONS, SOFT_AES, PREFETCH>(ctx[0], ctx[0]))
+		return;
 
 	// Optim - 90% time boundary
 	cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[0]->long_state, (__m128i*)ctx[0]->hash_state);
 
 	// Optim - 99% time boundary
 	keccakf((uint64_t*)ctx[0]->hash_state, 24);
-	extra_hashes[ctx[0]->hash_state[0] & 3](ctx[0]->hash_state, 200, (char*)output);
+	cn_extra_hash<SOFT_AES>(ctx[0]->hash_state, 200, (char*)output);
 }
 
-// This lovely creation will do 2 cn hashes at a time. We have plenty of space on silicon
-// to fit temporary vars for two contexts. Function will read len*2 from input and write 64 bytes to output
-// We are still limited by L3 cache, so doubling will only work with CPUs where we have more than 2MB to core (Xeons)
-template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
-void cryptonight_double_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+// Single phases of the hash as separate calls, only used by the kernel benchmark
+template<size_t MEM, bool SOFT_AES, bool PREFETCH>
+void cn_phase_explode(cryptonight_ctx* ctx)
+{
+	cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx->hash_state, (__m128i*)ctx->long_state);
+}
+
+template<size_t ITERATIONS, bool SOFT_AES, bool PREFETCH>
+void cn_phase_main_loop(cryptonight_ctx* ctx)
+{
+	cn_main_loop<ITERATIONS, SOFT_AES, PREFETCH>(ctx, ctx);
+}
+
+template<size_t MEM, bool SOFT_AES, bool PREFETCH>
+void cn_phase_implode(cryptonight_ctx* ctx)
+{
+	cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx->long_state, (__m128i*)ctx->hash_state);
+}
+
+// Keccak-f[1600] on W states at once for the multiway kernels, word j of every state lives in
+// st[j]. Same rounds as keccakf() in c_keccak.c, the ops come from the cn_keccak_x* structs.
+template<typename V>
+static inline void cn_keccakf_simd(typename V::vec* st)
 {
-	for (size_t i = 0; i < 2; i++)
+	typedef typename V::vec vec;
+	vec bc[5], t;
+
+	for (size_t round = 0; round < 24; round++)
 	{
-		keccak((const uint8_t *)input + len * i, len, ctx[i]->hash_state, 200);
-		cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->hash_state, (__m128i*)ctx[i]->long_state);
+		// Theta
+		for (size_t i = 0; i < 5; i++)
+			bc[i] = V::vxor3(V::vxor3(st[i], st[i + 5], st[i + 10]), st[i + 15], st[i + 20]);
+
+		for (size_t i = 0; i < 5; i++)
+		{
+			t = V::vxor(bc[(i + 4) % 5], V::template vrol<1>(bc[(i + 1) % 5]));
+			for (size_t j = 0; j < 25; j += 5)
+				st[i + j] = V::vxor(st[i + j], t);
+		}
+
+		// Rho Pi
+		t = st[1];
+		st[ 1] = V::template vrol<44>(st[ 6]);
+		st[ 6] = V::template vrol<20>(st[ 9]);
+		st[ 9] = V::template vrol<61>(st[22]);
+		st[22] = V::template vrol<39>(st[14]);
+		st[14] = V::template vrol<18>(st[20]);
+		st[20] = V::template vrol<62>(st[ 2]);
+		st[ 2] = V::template vrol<43>(st[12]);
+		st[12] = V::template vrol<25>(st[13]);
+		st[13] = V::template vrol< 8>(st[19]);
+		st[19] = V::template vrol<56>(st[23]);
+		st[23] = V::template vrol<41>(st[15]);
+		st[15] = V::template vrol<27>(st[ 4]);
+		st[ 4] = V::template vrol<14>(st[24]);
+		st[24] = V::template vrol< 2>(st[21]);
+		st[21] = V::template vrol<55>(st[ 8]);
+		st[ 8] = V::template vrol<45>(st[16]);
+		st[16] = V::template vrol<36>(st[ 5]);
+		st[ 5] = V::template vrol<28>(st[ 3]);
+		st[ 3] = V::template vrol<21>(st[18]);
+		st[18] = V::template vrol<15>(st[17]);
+		st[17] = V::template vrol<10>(st[11]);
+		st[11] = V::template vrol< 6>(st[ 7]);
+		st[ 7] = V::template vrol< 3>(st[10]);
+		st[10] = V::template vrol< 1>(t);
+
+		// Chi
+		for (size_t j = 0; j < 25; j += 5)
+		{
+			vec a0 = st[j], a1 = st[j + 1], a2 = st[j + 2], a3 = st[j + 3], a4 = st[j + 4];
+			st[j    ] = V::vchi(a0, a1, a2);
+			st[j + 1] = V::vchi(a1, a2, a3);
+			st[j + 2] = V::vchi(a2, a3, a4);
+			st[j + 3] = V::vchi(a3, a4, a0);
+			st[j + 4] = V::vchi(a4, a0, a1);
+		}
+
+		// Iota
+		st[0] = V::vxor(st[0], V::vset1(keccakf_rndc[round]));
 	}
+}
+
+static inline uint64_t cn_load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Lane k reads word j from p[k] + 8 * j. Missing lanes (k >= n) repeat the last one, their
+// result is never stored.
+template<typename V>
+static inline typename V::vec cn_keccak_gather(const uint8_t* const* p, size_t j)
+{
+	uint64_t w[V::W];
+	for (size_t k = 0; k < V::W; k++)
+		w[k] = cn_load64(p[k] + 8 * j);
+	return V::vload(w);
+}
+
+// Full Keccak of input + len * k into ctx[k]->hash_state like keccak(..., 200) does, n <= W lanes
+template<typename V>
+static inline void cn_keccak_simd(const uint8_t* input, size_t len, cryptonight_ctx** ctx, size_t n)
+{
+	constexpr size_t RATE = 136;
+	typename V::vec st[25];
+	const uint8_t* p[V::W];
+	uint8_t last[V::W][RATE];
+
+	for (size_t k = 0; k < V::W; k++)
+		p[k] = input + len * (k < n ? k : n - 1);
 
-	uint8_t* l0 = ctx[0]->long_state;
-	uint64_t* h0 = (uint64_t*)ctx[0]->hash_state;
-	uint8_t* l1 = ctx[1]->long_state;
-	uint64_t* h1 = (uint64_t*)ctx[1]->hash_state;
+	for (size_t j = 0; j < 25; j++)
+		st[j] = V::vset1(0);
 
-	__m128i ax0 = _mm_set_epi64x(h0[1] ^ h0[5], h0[0] ^ h0[4]);
-	__m128i bx0 = _mm_set_epi64x(h0[3] ^ h0[7], h0[2] ^ h0[6]);
-	__m128i ax1 = _mm_set_epi64x(h1[1] ^ h1[5], h1[0] ^ h1[4]);
-	__m128i bx1 = _mm_set_epi64x(h1[3] ^ h1[7], h1[2] ^ h1[6]);
-	__m128i cx0 = _mm_set_epi64x(0, 0);
-	__m128i cx1 = _mm_set_epi64x(0, 0);
+	size_t rest = len;
+	for ( ; rest >= RATE; rest -= RATE)
+	{
+		for (size_t j = 0; j < RATE / 8; j++)
+			st[j] = V::vxor(st[j], cn_keccak_gather<V>(p, j));
+		cn_keccakf_simd<V>(st);
+
+		for (size_t k = 0; k < V::W; k++)
+			p[k] += RATE;
+	}
 
-	for (size_t i = 0; i < ITERATIONS/2; i++)
+	// Last block and padding
+	for (size_t k = 0; k < V::W; k++)
 	{
-		uint64_t idx0, idx1, hi, lo;
-		__m128i *ptr0, *ptr1;
-
-		// EVEN ROUND
-		CN_STEP1(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP2(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP3(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP4(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, bx1, cx1, l1, ptr1, idx1);
-
-		// ODD ROUND
-		CN_STEP1(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP2(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP3(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP4(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, cx1, bx1, l1, ptr1, idx1);
+		memcpy(last[k], p[k], rest);
+		last[k][rest] = 1;
+		memset(last[k] + rest + 1, 0, RATE - rest - 1);
+		last[k][RATE - 1] |= 0x80;
+		p[k] = last[k];
 	}
 
-	for (size_t i = 0; i < 2; i++)
+	for (size_t j = 0; j < RATE / 8; j++)
+		st[j] = V::vxor(st[j], cn_keccak_gather<V>(p, j));
+	cn_keccakf_simd<V>(st);
+
+	for (size_t j = 0; j < 25; j++)
 	{
-		cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->long_state, (__m128i*)ctx[i]->hash_state);
-		keccakf((uint64_t*)ctx[i]->hash_state, 24);
-		extra_hashes[ctx[i]->hash_state[0] & 3](ctx[i]->hash_state, 200, (char*)output + 32 * i);
+		uint64_t w[V::W];
+		V::vstore(w, st[j]);
+		for (size_t k = 0; k < n; k++)
+			((uint64_t*)ctx[k]->hash_state)[j] = w[k];
 	}
 }
 
-// This lovelier creation will do 3 cn hashes at a time.
-template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
-void cryptonight_triple_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+// keccakf(hash_state, 24) of n <= W lanes
+template<typename V>
+static inline void cn_keccakf_simd_lanes(cryptonight_ctx** ctx, size_t n)
 {
-	for (size_t i = 0; i < 3; i++)
+	typename V::vec st[25];
+	const uint8_t* p[V::W];
+
+	for (size_t k = 0; k < V::W; k++)
+		p[k] = ctx[k < n ? k : n - 1]->hash_state;
+
+	for (size_t j = 0; j < 25; j++)
+		st[j] = cn_keccak_gather<V>(p, j);
+	cn_keccakf_simd<V>(st);
+
+	for (size_t j = 0; j < 25; j++)
 	{
-		keccak((const uint8_t *)input + len * i, len, ctx[i]->hash_state, 200);
-		cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->hash_state, (__m128i*)ctx[i]->long_state);
+		uint64_t w[V::W];
+		V::vstore(w, st[j]);
+		for (size_t k = 0; k < n; k++)
+			((uint64_t*)ctx[k]->hash_state)[j] = w[k];
 	}
+}
+
+#if defined(__AVX2__)
+struct cn_keccak_x4
+{
+	typedef __m256i vec;
+	static constexpr size_t W = 4;
+
+	static inline vec vload(const uint64_t* w) { return _mm256_loadu_si256((const __m256i*)w); }
+	static inline void vstore(uint64_t* w, vec a) { _mm256_storeu_si256((__m256i*)w, a); }
+	static inline vec vset1(uint64_t x) { return _mm256_set1_epi64x(x); }
+	static inline vec vxor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+	static inline vec vxor3(vec a, vec b, vec c) { return _mm256_xor_si256(_mm256_xor_si256(a, b), c); }
+	// a ^ (~b & c)
+	static inline vec vchi(vec a, vec b, vec c) { return _mm256_xor_si256(a, _mm256_andnot_si256(b, c)); }
+	template<int R>
+	static inline vec vrol(vec a) { return _mm256_or_si256(_mm256_slli_epi64(a, R), _mm256_srli_epi64(a, 64 - R)); }
+};
+#endif // __AVX2__
+
+#if defined(CN_KERNEL_AVX512)
+struct cn_keccak_x8
+{
+	typedef __m512i vec;
+	static constexpr size_t W = 8;
+
+	static inline vec vload(const uint64_t* w) { return _mm512_loadu_si512((const void*)w); }
+	static inline void vstore(uint64_t* w, vec a) { _mm512_storeu_si512((void*)w, a); }
+	static inline vec vset1(uint64_t x) { return _mm512_set1_epi64(x); }
+	static inline vec vxor(vec a, vec b) { return _mm512_xor_si512(a, b); }
+	static inline vec vxor3(vec a, vec b, vec c) { return _mm512_ternarylogic_epi64(a, b, c, 0x96); }
+	static inline vec vchi(vec a, vec b, vec c) { return _mm512_ternarylogic_epi64(a, b, c, 0xD2); }
+	template<int R>
+	static inline vec vrol(vec a) { return _mm512_rol_epi64(a, R); }
+};
+#endif // CN_KERNEL_AVX512
+
+// Keccak at the start of a multiway hash, input + len * i into ctx[i]->hash_state for i < N.
+// AVX-512 does up to 8 lanes per pass and AVX2 4, a single lane left over goes to keccak().
+static inline void cn_keccak_lanes(const void* input, size_t len, cryptonight_ctx** ctx, size_t N)
+{
+	const uint8_t* in = (const uint8_t*)input;
+	size_t i = 0;
+#if defined(CN_KERNEL_AVX512)
+	for ( ; i + 5 <= N; i += 8)
+		cn_keccak_simd<cn_keccak_x8>(in + len * i, len, ctx + i, N - i < 8 ? N - i : 8);
+#endif
+#if defined(__AVX2__)
+	for ( ; i + 2 <= N; i += 4)
+		cn_keccak_simd<cn_keccak_x4>(in + len * i, len, ctx + i, N - i < 4 ? N - i : 4);
+#endif
+	for ( ; i < N; i++)
+		keccak(in + len * i, len, ctx[i]->hash_state, 200);
+}
 
-	uint8_t* l0 = ctx[0]->long_state;
-	uint64_t* h0 = (uint64_t*)ctx[0]->hash_state;
-	uint8_t* l1 = ctx[1]->long_state;
-	uint64_t* h1 = (uint64_t*)ctx[1]->hash_state;
-	uint8_t* l2 = ctx[2]->long_state;
-	uint64_t* h2 = (uint64_t*)ctx[2]->hash_state;
-
-	__m128i ax0 = _mm_set_epi64x(h0[1] ^ h0[5], h0[0] ^ h0[4]);
-	__m128i bx0 = _mm_set_epi64x(h0[3] ^ h0[7], h0[2] ^ h0[6]);
-	__m128i ax1 = _mm_set_epi64x(h1[1] ^ h1[5], h1[0] ^ h1[4]);
-	__m128i bx1 = _mm_set_epi64x(h1[3] ^ h1[7], h1[2] ^ h1[6]);
-	__m128i ax2 = _mm_set_epi64x(h2[1] ^ h2[5], h2[0] ^ h2[4]);
-	__m128i bx2 = _mm_set_epi64x(h2[3] ^ h2[7], h2[2] ^ h2[6]);
-	__m128i cx0 = _mm_set_epi64x(0, 0);
-	__m128i cx1 = _mm_set_epi64x(0, 0);
-	__m128i cx2 = _mm_set_epi64x(0, 0);
-
-	for (size_t i = 0; i < ITERATIONS/2; i++)
+// keccakf at the end of a multiway hash, on the hash_state of ctx[0] to ctx[N-1]
+static inline void cn_keccakf_lanes(cryptonight_ctx** ctx, size_t N)
+{
+	size_t i = 0;
+#if defined(CN_KERNEL_AVX512)
+	for ( ; i + 5 <= N; i += 8)
+		cn_keccakf_simd_lanes<cn_keccak_x8>(ctx + i, N - i < 8 ? N - i : 8);
+#endif
+#if defined(__AVX2__)
+	for ( ; i + 2 <= N; i += 4)
+		cn_keccakf_simd_lanes<cn_keccak_x4>(ctx + i, N - i < 4 ? N - i : 4);
+#endif
+	for ( ; i < N; i++)
+		keccakf((uint64_t*)ctx[i]->hash_state, 24);
+}
+
+// C++11 has no std::index_sequence, this is the minimal version of it
+template<size_t... I>
+struct cn_index_seq {};
+
+template<size_t N, size_t... I>
+struct cn_make_index_seq : cn_make_index_seq<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct cn_make_index_seq<0, I...> { typedef cn_index_seq<I...> type; };
+
+// Runs the expression once for every lane I, in lane order
+#define CN_FOR_EACH_LANE(x) { int cn_lanes[] = { ((x), 0)... }; (void)cn_lanes; }
+
+// This lovely creation will do N cn hashes at a time. We have plenty of space on silicon
+// to fit temporary vars for several contexts. Function will read len*N from input and write 32*N bytes to output.
+// We are still limited by L3 cache, so this will only work with CPUs where we have more than 2MB per lane (Xeons)
+template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH, size_t... I>
+void cryptonight_multi_hash_lanes(cn_index_seq<I...>, const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+{
+	constexpr size_t N = sizeof...(I);
+	uint8_t* l[N];
+	__m128i ax[N], bx[N], cx[N];
+	__m128i* ptr[N];
+	uint64_t idx[N];
+
+	cn_keccak_lanes(input, len, ctx, N);
+
+	for (size_t i = 0; i < N; i++)
 	{
-		uint64_t idx0, idx1, idx2, hi, lo;
-		__m128i *ptr0, *ptr1, *ptr2;
-
-		// EVEN ROUND
-		CN_STEP1(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, bx2, cx2, l2, ptr2, idx2);
-
-		CN_STEP2(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, bx2, cx2, l2, ptr2, idx2);
-
-		CN_STEP3(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, bx2, cx2, l2, ptr2, idx2);
-
-		CN_STEP4(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, bx2, cx2, l2, ptr2, idx2);
-
-		// ODD ROUND
-		CN_STEP1(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, cx2, bx2, l2, ptr2, idx2);
-
-		CN_STEP2(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, cx2, bx2, l2, ptr2, idx2);
-
-		CN_STEP3(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, cx2, bx2, l2, ptr2, idx2);
-
-		CN_STEP4(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, cx2, bx2, l2, ptr2, idx2);
+		cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->hash_state, (__m128i*)ctx[i]->long_state);
+
+		uint64_t* h = (uint64_t*)ctx[i]->hash_state;
+		l[i] = ctx[i]->long_state;
+		ax[i] = _mm_set_epi64x(h[1] ^ h[5], h[0] ^ h[4]);
+		bx[i] = _mm_set_epi64x(h[3] ^ h[7], h[2] ^ h[6]);
+		cx[i] = _mm_set_epi64x(0, 0);
+
+		// Explode is the first half of the cost of a lane, don't start another one for a stale job
+		if(cn_cancelled(ctx[0]))
+			return;
 	}
 
-	for (size_t i = 0; i < 3; i++)
+	static_assert(ITERATIONS % CN_CANCEL_ROUNDS == 0, "ITERATIONS has to be a multiple of CN_CANCEL_ROUNDS");
+	for (size_t j = 0; j < ITERATIONS; j += CN_CANCEL_ROUNDS)
 	{
-		cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->long_state, (__m128i*)ctx[i]->hash_state);
-		keccakf((uint64_t*)ctx[i]->hash_state, 24);
-		extra_hashes[ctx[i]->hash_state[0] & 3](ctx[i]->hash_state, 200, (char*)output + 32 * i);
+		for (size_t i = 0; i < CN_CANCEL_ROUNDS/2; i++)
+		{
+			// EVEN ROUND
+			CN_FOR_EACH_LANE(cn_step1<PREFETCH>(ax[I], cx[I], l[I], ptr[I], idx[I]));
+			CN_FOR_EACH_LANE(cn_step2<SOFT_AES>(ax[I], bx[I], cx[I], ptr[I]));
+			CN_FOR_EACH_LANE(cn_step3<PREFETCH>(bx[I], cx[I], l[I], ptr[I], idx[I]));
+			CN_FOR_EACH_LANE(cn_step4(ax[I], bx[I], ptr[I], idx[I]));
+
+			// ODD ROUND
+			CN_FOR_EACH_LANE(cn_step1<PREFETCH>(ax[I], bx[I], l[I], ptr[I], idx[I]));
+			CN_FOR_EACH_LANE(cn_step2<SOFT_AES>(ax[I], cx[I], bx[I], ptr[I]));
+			CN_FOR_EACH_LANE(cn_step3<PREFETCH>(cx[I], bx[I], l[I], ptr[I], idx[I]));
+			CN_FOR_EACH_LANE(cn_step4(ax[I], cx[I], ptr[I], idx[I]));
+		}
+
+		if(cn_cancelled(ctx[0]))
+			return;
 	}
+
+	for (size_t i = 0; i < N; i++)
+		cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->long_state, (__m128i*)ctx[i]->hash_state);
+
+	cn_keccakf_lanes(ctx, N);
+	for (size_t i = 0; i < N; i++)
+		cn_extra_hash<SOFT_AES>(ctx[i]->hash_state, 200, (char*)output + 32 * i);
 }
 
-// This even lovelier creation will do 4 cn hashes at a time.
-template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
-void cryptonight_quad_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+template<size_t N, size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
+void cryptonight_multi_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+{
+	cryptonight_multi_hash_lanes<ITERATIONS, MEM, SOFT_AES, PREFETCH>(
+		typename cn_make_index_seq<N>::type(), input, len, output, ctx);
+}
+
+// Explode and implode cut into 128 byte chunks for the pipelined kernel, which slots one chunk
+// between two main loop rounds of the other lanes. Always the 128-bit AES version.
+template<bool SOFT_AES>
+struct cn_aes_chunks
 {
-	for (size_t i = 0; i < 4; i++)
+	__m128i k[10];
+	__m128i x[8];
+
+	void init(const __m128i* key, const __m128i* state)
 	{
-		keccak((const uint8_t *)input + len * i, len, ctx[i]->hash_state, 200);
-		cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->hash_state, (__m128i*)ctx[i]->long_state);
+		aes_genkey<SOFT_AES>(key, &k[0], &k[1], &k[2], &k[3], &k[4], &k[5], &k[6], &k[7], &k[8], &k[9]);
+		for (size_t i = 0; i < 8; i++)
+			x[i] = _mm_load_si128(state + i);
 	}
 
-	uint8_t* l0 = ctx[0]->long_state;
-	uint64_t* h0 = (uint64_t*)ctx[0]->hash_state;
-	uint8_t* l1 = ctx[1]->long_state;
-	uint64_t* h1 = (uint64_t*)ctx[1]->hash_state;
-	uint8_t* l2 = ctx[2]->long_state;
-	uint64_t* h2 = (uint64_t*)ctx[2]->hash_state;
-	uint8_t* l3 = ctx[3]->long_state;
-	uint64_t* h3 = (uint64_t*)ctx[3]->hash_state;
-
-	__m128i ax0 = _mm_set_epi64x(h0[1] ^ h0[5], h0[0] ^ h0[4]);
-	__m128i bx0 = _mm_set_epi64x(h0[3] ^ h0[7], h0[2] ^ h0[6]);
-	__m128i ax1 = _mm_set_epi64x(h1[1] ^ h1[5], h1[0] ^ h1[4]);
-	__m128i bx1 = _mm_set_epi64x(h1[3] ^ h1[7], h1[2] ^ h1[6]);
-	__m128i ax2 = _mm_set_epi64x(h2[1] ^ h2[5], h2[0] ^ h2[4]);
-	__m128i bx2 = _mm_set_epi64x(h2[3] ^ h2[7], h2[2] ^ h2[6]);
-	__m128i ax3 = _mm_set_epi64x(h3[1] ^ h3[5], h3[0] ^ h3[4]);
-	__m128i bx3 = _mm_set_epi64x(h3[3] ^ h3[7], h3[2] ^ h3[6]);
-	__m128i cx0 = _mm_set_epi64x(0, 0);
-	__m128i cx1 = _mm_set_epi64x(0, 0);
-	__m128i cx2 = _mm_set_epi64x(0, 0);
-	__m128i cx3 = _mm_set_epi64x(0, 0);
-
-	for (size_t i = 0; i < ITERATIONS/2; i++)
+	void rounds()
 	{
-		uint64_t idx0, idx1, idx2, idx3, hi, lo;
-		__m128i *ptr0, *ptr1, *ptr2, *ptr3;
-
-		// EVEN ROUND
-		CN_STEP1(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP1(ax3, bx3, cx3, l3, ptr3, idx3);
-
-		CN_STEP2(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP2(ax3, bx3, cx3, l3, ptr3, idx3);
-
-		CN_STEP3(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP3(ax3, bx3, cx3, l3, ptr3, idx3);
-
-		CN_STEP4(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP4(ax3, bx3, cx3, l3, ptr3, idx3);
-
-		// ODD ROUND
-		CN_STEP1(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP1(ax3, cx3, bx3, l3, ptr3, idx3);
-
-		CN_STEP2(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP2(ax3, cx3, bx3, l3, ptr3, idx3);
-
-		CN_STEP3(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP3(ax3, cx3, bx3, l3, ptr3, idx3);
-
-		CN_STEP4(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP4(ax3, cx3, bx3, l3, ptr3, idx3);
+		for (size_t r = 0; r < 10; r++)
+		{
+			if(SOFT_AES)
+				soft_aes_round(k[r], &x[0], &x[1], &x[2], &x[3], &x[4], &x[5], &x[6], &x[7]);
+			else
+				aes_round(k[r], &x[0], &x[1], &x[2], &x[3], &x[4], &x[5], &x[6], &x[7]);
+		}
 	}
 
-	for (size_t i = 0; i < 4; i++)
+	void explode_chunk(__m128i* output)
 	{
-		cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->long_state, (__m128i*)ctx[i]->hash_state);
-		keccakf((uint64_t*)ctx[i]->hash_state, 24);
-		extra_hashes[ctx[i]->hash_state[0] & 3](ctx[i]->hash_state, 200, (char*)output + 32 * i);
+		rounds();
+		for (size_t i = 0; i < 8; i++)
+			_mm_store_si128(output + i, x[i]);
+	}
+
+	void implode_chunk(const __m128i* input)
+	{
+		for (size_t i = 0; i < 8; i++)
+			x[i] = _mm_xor_si128(_mm_load_si128(input + i), x[i]);
+		rounds();
+	}
+};
+
+// One even and one odd round of every lane I for which ACTIVE is true
+#define CN_PIPE_ROUND_PAIR(ACTIVE) \
+	{ \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step1<PREFETCH>(ax[I], cx[I], l[I], ptr[I], idx[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step2<SOFT_AES>(ax[I], bx[I], cx[I], ptr[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step3<PREFETCH>(bx[I], cx[I], l[I], ptr[I], idx[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step4(ax[I], bx[I], ptr[I], idx[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step1<PREFETCH>(ax[I], bx[I], l[I], ptr[I], idx[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step2<SOFT_AES>(ax[I], cx[I], bx[I], ptr[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step3<PREFETCH>(cx[I], bx[I], l[I], ptr[I], idx[I]) : (void)0); \
+		CN_FOR_EACH_LANE((ACTIVE) ? cn_step4(ax[I], cx[I], ptr[I], idx[I]) : (void)0); \
+	}
+
+// Lane K's turn in the pipeline. It finishes the hash it started in the previous call and
+// explodes its new input, one chunk per round pair of the other lanes, then all lanes run
+// iSharedPairs round pairs together. False if the job changed on the way.
+template<size_t K, size_t MEM, bool SOFT_AES, bool PREFETCH, size_t... I>
+static inline bool cn_pipe_tick(cn_index_seq<I...>, const uint8_t* input, size_t len, uint8_t* output,
+	cryptonight_ctx** ctx, uint8_t** l, __m128i* ax, __m128i* bx, __m128i* cx, size_t iSharedPairs)
+{
+	constexpr size_t CHUNKS = MEM / (8 * sizeof(__m128i));
+	__m128i* ptr[sizeof...(I)];
+	uint64_t idx[sizeof...(I)];
+	__m128i* state = (__m128i*)ctx[K]->hash_state;
+	cn_aes_chunks<SOFT_AES> aes;
+
+	aes.init(state + 2, state + 4);
+	for (size_t i = 0; i < CHUNKS; i++)
+	{
+		CN_PIPE_ROUND_PAIR(I != K);
+		aes.implode_chunk((const __m128i*)l[K] + 8 * i);
+	}
+
+	for (size_t i = 0; i < 8; i++)
+		_mm_store_si128(state + 4 + i, aes.x[i]);
+	keccakf((uint64_t*)ctx[K]->hash_state, 24);
+	cn_extra_hash<SOFT_AES>(ctx[K]->hash_state, 200, (char*)output + 32 * K);
+
+	keccak(input + len * K, len, ctx[K]->hash_state, 200);
+	aes.init(state, state + 4);
+	for (size_t i = 0; i < CHUNKS; i++)
+	{
+		CN_PIPE_ROUND_PAIR(I != K);
+		aes.explode_chunk((__m128i*)l[K] + 8 * i);
+	}
+
+	uint64_t* h = (uint64_t*)ctx[K]->hash_state;
+	ax[K] = _mm_set_epi64x(h[1] ^ h[5], h[0] ^ h[4]);
+	bx[K] = _mm_set_epi64x(h[3] ^ h[7], h[2] ^ h[6]);
+	cx[K] = _mm_set_epi64x(0, 0);
+
+	for (size_t j = 0; j < iSharedPairs; j += CN_CANCEL_ROUNDS/2)
+	{
+		if(cn_cancelled(ctx[0]))
+			return false;
+
+		size_t iEnd = j + CN_CANCEL_ROUNDS/2 < iSharedPairs ? j + CN_CANCEL_ROUNDS/2 : iSharedPairs;
+		for (size_t i = j; i < iEnd; i++)
+			CN_PIPE_ROUND_PAIR(true);
 	}
+	return !cn_cancelled(ctx[0]);
 }
 
-// This most lovely creation will do 5 cn hashes at a time.
-template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
-void cryptonight_penta_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+// Software pipelined version of cryptonight_multi_hash. The lanes are 1/N of a hash apart
+// instead of in lockstep, so the explode and implode of one lane (compute bound) run while
+// the others are in their main loop (memory bound) and fill the AES units during its stalls.
+// The output is one call behind: output i is the hash of input i of the previous call, the
+// first call after a start or a cancellation gives garbage. All contexts have to stay with
+// the same lane from call to call.
+template<size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH, size_t... I>
+void cryptonight_pipe_hash_lanes(cn_index_seq<I...> seq, const void* input, size_t len, void* output, cryptonight_ctx** ctx)
 {
-	for (size_t i = 0; i < 5; i++)
+	constexpr size_t N = sizeof...(I);
+	constexpr size_t CHUNKS = MEM / (8 * sizeof(__m128i));
+
+	// While lane K takes its turn the others run 2 * CHUNKS round pairs, the rest of every
+	// hash is spread over the shared part of the N turns
+	static_assert((N - 1) * 2 * CHUNKS <= ITERATIONS/2, "Too many lanes for the pipeline");
+	constexpr size_t SHARED = ITERATIONS/2 - (N - 1) * 2 * CHUNKS;
+
+	uint8_t* l[N];
+	__m128i ax[N], bx[N], cx[N];
+	for (size_t i = 0; i < N; i++)
 	{
-		keccak((const uint8_t *)input + len * i, len, ctx[i]->hash_state, 200);
-		cn_explode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->hash_state, (__m128i*)ctx[i]->long_state);
+		l[i] = ctx[i]->long_state;
+		ax[i] = _mm_loadu_si128((const __m128i*)ctx[i]->pipe_state);
+		bx[i] = _mm_loadu_si128((const __m128i*)ctx[i]->pipe_state + 1);
+		cx[i] = _mm_loadu_si128((const __m128i*)ctx[i]->pipe_state + 2);
 	}
 
-	uint8_t* l0 = ctx[0]->long_state;
-	uint64_t* h0 = (uint64_t*)ctx[0]->hash_state;
-	uint8_t* l1 = ctx[1]->long_state;
-	uint64_t* h1 = (uint64_t*)ctx[1]->hash_state;
-	uint8_t* l2 = ctx[2]->long_state;
-	uint64_t* h2 = (uint64_t*)ctx[2]->hash_state;
-	uint8_t* l3 = ctx[3]->long_state;
-	uint64_t* h3 = (uint64_t*)ctx[3]->hash_state;
-	uint8_t* l4 = ctx[4]->long_state;
-	uint64_t* h4 = (uint64_t*)ctx[4]->hash_state;
-
-	__m128i ax0 = _mm_set_epi64x(h0[1] ^ h0[5], h0[0] ^ h0[4]);
-	__m128i bx0 = _mm_set_epi64x(h0[3] ^ h0[7], h0[2] ^ h0[6]);
-	__m128i ax1 = _mm_set_epi64x(h1[1] ^ h1[5], h1[0] ^ h1[4]);
-	__m128i bx1 = _mm_set_epi64x(h1[3] ^ h1[7], h1[2] ^ h1[6]);
-	__m128i ax2 = _mm_set_epi64x(h2[1] ^ h2[5], h2[0] ^ h2[4]);
-	__m128i bx2 = _mm_set_epi64x(h2[3] ^ h2[7], h2[2] ^ h2[6]);
-	__m128i ax3 = _mm_set_epi64x(h3[1] ^ h3[5], h3[0] ^ h3[4]);
-	__m128i bx3 = _mm_set_epi64x(h3[3] ^ h3[7], h3[2] ^ h3[6]);
-	__m128i ax4 = _mm_set_epi64x(h4[1] ^ h4[5], h4[0] ^ h4[4]);
-	__m128i bx4 = _mm_set_epi64x(h4[3] ^ h4[7], h4[2] ^ h4[6]);
-	__m128i cx0 = _mm_set_epi64x(0, 0);
-	__m128i cx1 = _mm_set_epi64x(0, 0);
-	__m128i cx2 = _mm_set_epi64x(0, 0);
-	__m128i cx3 = _mm_set_epi64x(0, 0);
-	__m128i cx4 = _mm_set_epi64x(0, 0);
-
-	for (size_t i = 0; i < ITERATIONS/2; i++)
+	// Turns in lane order, the ones after a cancellation are skipped
+	bool bOk = true;
+	int turns[] = { (bOk = bOk && cn_pipe_tick<I, MEM, SOFT_AES, PREFETCH>(seq, (const uint8_t*)input, len,
+		(uint8_t*)output, ctx, l, ax, bx, cx, SHARED / N + (I == 0 ? SHARED % N : 0)), 0)... };
+	(void)turns;
+
+	for (size_t i = 0; i < N; i++)
 	{
-		uint64_t idx0, idx1, idx2, idx3, idx4, hi, lo;
-		__m128i *ptr0, *ptr1, *ptr2, *ptr3, *ptr4;
-
-		// EVEN ROUND
-		CN_STEP1(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP1(ax3, bx3, cx3, l3, ptr3, idx3);
-		CN_STEP1(ax4, bx4, cx4, l4, ptr4, idx4);
-
-		CN_STEP2(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP2(ax3, bx3, cx3, l3, ptr3, idx3);
-		CN_STEP2(ax4, bx4, cx4, l4, ptr4, idx4);
-
-		CN_STEP3(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP3(ax3, bx3, cx3, l3, ptr3, idx3);
-		CN_STEP3(ax4, bx4, cx4, l4, ptr4, idx4);
-
-		CN_STEP4(ax0, bx0, cx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, bx1, cx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, bx2, cx2, l2, ptr2, idx2);
-		CN_STEP4(ax3, bx3, cx3, l3, ptr3, idx3);
-		CN_STEP4(ax4, bx4, cx4, l4, ptr4, idx4);
-
-		// ODD ROUND
-		CN_STEP1(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP1(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP1(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP1(ax3, cx3, bx3, l3, ptr3, idx3);
-		CN_STEP1(ax4, cx4, bx4, l4, ptr4, idx4);
-
-		CN_STEP2(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP2(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP2(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP2(ax3, cx3, bx3, l3, ptr3, idx3);
-		CN_STEP2(ax4, cx4, bx4, l4, ptr4, idx4);
-
-		CN_STEP3(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP3(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP3(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP3(ax3, cx3, bx3, l3, ptr3, idx3);
-		CN_STEP3(ax4, cx4, bx4, l4, ptr4, idx4);
-
-		CN_STEP4(ax0, cx0, bx0, l0, ptr0, idx0);
-		CN_STEP4(ax1, cx1, bx1, l1, ptr1, idx1);
-		CN_STEP4(ax2, cx2, bx2, l2, ptr2, idx2);
-		CN_STEP4(ax3, cx3, bx3, l3, ptr3, idx3);
-		CN_STEP4(ax4, cx4, bx4, l4, ptr4, idx4);
+		_mm_storeu_si128((__m128i*)ctx[i]->pipe_state, ax[i]);
+		_mm_storeu_si128((__m128i*)ctx[i]->pipe_state + 1, bx[i]);
+		_mm_storeu_si128((__m128i*)ctx[i]->pipe_state + 2, cx[i]);
 	}
+}
+
+template<size_t N, size_t ITERATIONS, size_t MEM, bool SOFT_AES, bool PREFETCH>
+void cryptonight_pipe_hash(const void* input, size_t len, void* output, cryptonight_ctx** ctx)
+{
+	cryptonight_pipe_hash_lanes<ITERATIONS, MEM, SOFT_AES, PREFETCH>(
+		typename cn_make_index_seq<N>::type(), input, len, output, ctx);
+}
+
+// Kernel table of one translation unit, N ways by NO_PREFETCH. The single hash has its own
+// kernel, the multiway ones are generated from the index sequence
+template<bool SOFT_AES, size_t... I>
+cn_hash_fun cn_kernel_table_lanes(cn_index_seq<I...>, size_t N, bool bNoPrefetch)
+{
+	static const cn_hash_fun func_table[2 * CN_MAX_N] = {
+		cryptonight_hash<0x80000, MEMORY, SOFT_AES, true>,
+		cryptonight_hash<0x80000, MEMORY, SOFT_AES, false>,
+		(I % 2 == 0 ? cryptonight_multi_hash<I / 2 + 2, 0x80000, MEMORY, SOFT_AES, true> :
+			cryptonight_multi_hash<I / 2 + 2, 0x80000, MEMORY, SOFT_AES, false>)...
+	};
+
+	N = (N < 1) ? 1 : (N > CN_MAX_N) ? CN_MAX_N : N;
+	return func_table[2 * (N - 1) + (bNoPrefetch ? 1 : 0)];
+}
+
+template<bool SOFT_AES>
+cn_hash_fun cn_kernel_table(size_t N, bool bNoPrefetch)
+{
+	return cn_kernel_table_lanes<SOFT_AES>(typename cn_make_index_seq<2 * (CN_MAX_N - 1)>::type(), N, bNoPrefetch);
+}
 
-	for (size_t i = 0; i < 5; i++)
+// Pipelined kernels for 2 to CN_MAX_N lanes, by NO_PREFETCH
+template<bool SOFT_AES, size_t... I>
+cn_hash_fun cn_pipe_kernel_table_lanes(cn_index_seq<I...>, size_t N, bool bNoPrefetch)
+{
+	static const cn_hash_fun func_table[2 * (CN_MAX_N - 1)] = {
+		(I % 2 == 0 ? cryptonight_pipe_hash<I / 2 + 2, 0x80000, MEMORY, SOFT_AES, true> :
+			cryptonight_pipe_hash<I / 2 + 2, 0x80000, MEMORY, SOFT_AES, false>)...
+	};
+
+	if(N < 2)
+		return nullptr;
+	N = (N > CN_MAX_N) ? CN_MAX_N : N;
+	return func_table[2 * (N - 2) + (bNoPrefetch ? 1 : 0)];
+}
+
+template<bool SOFT_AES>
+cn_hash_fun cn_pipe_kernel_table(size_t N, bool bNoPrefetch)
+{
+	return cn_pipe_kernel_table_lanes<SOFT_AES>(typename cn_make_index_seq<2 * (CN_MAX_N - 1)>::type(), N, bNoPrefetch);
+}
+
+template<bool SOFT_AES>
+cn_phase_funs cn_phase_table(bool bNoPrefetch)
+{
+	cn_phase_funs funs;
+	if(bNoPrefetch)
 	{
-		cn_implode_scratchpad<MEM, SOFT_AES, PREFETCH>((__m128i*)ctx[i]->long_state, (__m128i*)ctx[i]->hash_state);
-		keccakf((uint64_t*)ctx[i]->hash_state, 24);
-		extra_hashes[ctx[i]->hash_state[0] & 3](ctx[i]->hash_state, 200, (char*)output + 32 * i);
+		funs.explode = cn_phase_explode<MEMORY, SOFT_AES, false>;
+		funs.main_loop = cn_phase_main_loop<0x80000, SOFT_AES, false>;
+		funs.implode = cn_phase_implode<MEMORY, SOFT_AES, false>;
 	}
+	else
+	{
+		funs.explode = cn_phase_explode<MEMORY, SOFT_AES, true>;
+		funs.main_loop = cn_phase_main_loop<0x80000, SOFT_AES, true>;
+		funs.implode = cn_phase_implode<MEMORY, SOFT_AES, true>;
+	}
+	funs.keccak = cn_keccak_lanes;
+	funs.keccakf = cn_keccakf_lanes;
+	funs.extra_hash = cn_extra_hash<SOFT_AES>;
+	return funs;
 }
+
+} // namespace
@@ -27,9 +27,11 @@ extern "C"
 #include "c_blake256.h"
 #include "c_jh.h"
 #include "c_skein.h"
+	void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
+	void keccakf(uint64_t st[25], int rounds);
 }
 #include "cryptonight.h"
-#include "cryptonight_aesni.h"
+#include "cryptonight_kernels.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -67,8 +69,140 @@ void do_skein_hash(const void* input, size_t len, char* output) {
 	skein_hash(8 * 32, (const uint8_t*)input, 8 * len, (uint8_t*)output);
 }
 
+extern "C" void(*const extra_hashes[4])(const void *, size_t, char *);
 void (* const extra_hashes[4])(const void *, size_t, char *) = {do_blake_hash, do_groestl_hash, do_jh_hash, do_skein_hash};
 
+static cn_hash_fun cn_kernels_isa(cn_isa isa, size_t N, bool bNoPrefetch)
+{
+	switch(isa)
+	{
+	case cn_isa_avx512:
+		return cn_kernels_avx512(N, bNoPrefetch);
+	case cn_isa_vaes:
+		return cn_kernels_vaes(N, bNoPrefetch);
+	case cn_isa_avx2:
+		return cn_kernels_avx2(N, bNoPrefetch);
+	case cn_isa_aes:
+		return cn_kernels_aes(N, bNoPrefetch);
+	case cn_isa_soft:
+	default:
+		return cn_kernels_soft(N, bNoPrefetch);
+	}
+}
+
+cn_isa cn_compiled_isa(cn_isa isa)
+{
+	while(isa != cn_isa_soft && cn_kernels_isa(isa, 1, false) == nullptr)
+		isa = (cn_isa)(isa - 1);
+	return isa;
+}
+
+cn_hash_fun cn_select_kernel(cn_isa isa, size_t N, bool bNoPrefetch)
+{
+	return cn_kernels_isa(cn_compiled_isa(isa), N, bNoPrefetch);
+}
+
+cn_hash_fun cn_select_pipe_kernel(cn_isa isa, size_t N, bool bNoPrefetch)
+{
+	switch(cn_compiled_isa(isa))
+	{
+	case cn_isa_avx512:
+		return cn_pipe_kernels_avx512(N, bNoPrefetch);
+	case cn_isa_vaes:
+		return cn_pipe_kernels_vaes(N, bNoPrefetch);
+	case cn_isa_avx2:
+		return cn_pipe_kernels_avx2(N, bNoPrefetch);
+	case cn_isa_aes:
+		return cn_pipe_kernels_aes(N, bNoPrefetch);
+	case cn_isa_soft:
+	default:
+		return cn_pipe_kernels_soft(N, bNoPrefetch);
+	}
+}
+
+cn_phase_funs cn_select_phases(cn_isa isa, bool bNoPrefetch)
+{
+	switch(cn_compiled_isa(isa))
+	{
+	case cn_isa_avx512:
+		return cn_phases_avx512(bNoPrefetch);
+	case cn_isa_vaes:
+		return cn_phases_vaes(bNoPrefetch);
+	case cn_isa_avx2:
+		return cn_phases_avx2(bNoPrefetch);
+	case cn_isa_aes:
+		return cn_phases_aes(bNoPrefetch);
+	case cn_isa_soft:
+	default:
+		return cn_phases_soft(bNoPrefetch);
+	}
+}
+
+bool cn_keccak_self_test(cn_isa isa, cryptonight_ctx** ctx)
+{
+	// 200 bytes is more than one block (136), that covers the absorb loop and the padding
+	const size_t iLen = 200;
+	uint8_t bInput[iLen * CN_MAX_N];
+	uint8_t bRef[200 * CN_MAX_N];
+	cn_phase_funs funs = cn_select_phases(isa, false);
+	bool bResult = true;
+
+	for(size_t i = 0; i < sizeof(bInput); i++)
+		bInput[i] = (uint8_t)(i * 7 + i / iLen);
+
+	for(size_t n = 1; n <= CN_MAX_N; n++)
+	{
+		funs.keccak(bInput, iLen, ctx, n);
+		for(size_t i = 0; i < n; i++)
+		{
+			keccak(bInput + iLen * i, iLen, bRef + 200 * i, 200);
+			bResult &= memcmp(ctx[i]->hash_state, bRef + 200 * i, 200) == 0;
+		}
+
+		funs.keccakf(ctx, n);
+		for(size_t i = 0; i < n; i++)
+		{
+			keccakf((uint64_t*)(bRef + 200 * i), 24);
+			bResult &= memcmp(ctx[i]->hash_state, bRef + 200 * i, 200) == 0;
+		}
+	}
+
+	return bResult;
+}
+
+bool cn_extra_hash_self_test(cn_isa isa)
+{
+	// One or two padding blocks, with and without message bytes in the last one. 200 is what the kernels hash.
+	static const size_t iLens[] = { 1, 55, 56, 63, 64, 65, 119, 128, 200 };
+	uint8_t bInput[200];
+	char sOut[32], sRef[32];
+	cn_phase_funs funs = cn_select_phases(isa, false);
+	bool bResult = true;
+
+	for(size_t i = 0; i < sizeof(bInput); i++)
+		bInput[i] = (uint8_t)(i * 13 + 5);
+
+	for(size_t l = 0; l < sizeof(iLens) / sizeof(iLens[0]); l++)
+	{
+		// The first byte picks the hash
+		for(uint8_t h = 0; h < 4; h++)
+		{
+			bInput[0] = (uint8_t)(l << 2) | h;
+			funs.extra_hash(bInput, iLens[l], sOut);
+			extra_hashes[h](bInput, iLens[l], sRef);
+			bResult &= memcmp(sOut, sRef, 32) == 0;
+		}
+	}
+
+	return bResult;
+}
+
+const char* cn_isa_name(cn_isa isa)
+{
+	static const char* const names[cn_isa_count] = { "soft-aes", "aes", "avx2", "vaes", "avx512" };
+	return isa < cn_isa_count ? names[isa] : "unknown";
+}
+
 #ifdef _WIN32
 BOOL AddPrivilege(TCHAR* pszPrivilege)
 {
@@ -108,16 +242,79 @@ size_t cryptonight_init(size_t use_fast_mem, size_t use_mlock, alloc_msg* msg)
 #endif // _WIN32
 }
 
+size_t cryptonight_thp_bytes(const void* mem)
+{
+#if defined(__linux__)
+	FILE* f = fopen("/proc/self/smaps", "r");
+	if(f == NULL)
+		return 0;
+
+	char line[256];
+	uintptr_t addr = (uintptr_t)mem;
+	bool in_vma = false;
+	size_t kb = 0;
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned long long start, end;
+		// Mapping header lines are "start-end perms ...", the rest are "Key: value kB"
+		if(sscanf(line, "%llx-%llx ", &start, &end) == 2)
+		{
+			if(in_vma)
+				break;
+			in_vma = addr >= start && addr < end;
+		}
+		else if(in_vma && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			break;
+	}
+
+	fclose(f);
+	return kb * 1024;
+#else
+	return 0;
+#endif
+}
+
 cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, alloc_msg* msg)
 {
 	cryptonight_ctx* ptr = (cryptonight_ctx*)_mm_malloc(sizeof(cryptonight_ctx), 4096);
+	if(ptr == NULL)
+	{
+		if(msg != NULL)
+			msg->warning = "_mm_malloc failed";
+		return NULL;
+	}
+
+	memset(ptr->ctx_info, 0, sizeof(ptr->ctx_info));
+	ptr->cancel_epoch = nullptr;
+	ptr->epoch = 0;
+	ptr->cancelled = 0;
 
 	if(use_fast_mem == 0)
 	{
 		// use 2MiB aligned memory
 		ptr->long_state = (uint8_t*)_mm_malloc(MEMORY, 2*1024*1024);
+		if(ptr->long_state == NULL)
+		{
+			_mm_free(ptr);
+			if(msg != NULL)
+				msg->warning = "_mm_malloc failed";
+			return NULL;
+		}
+
 		ptr->ctx_info[0] = 0;
 		ptr->ctx_info[1] = 0;
+
+#if defined(__linux__)
+		// Ask for a transparent huge page. The allocation is 2MB aligned, so the advice splits off a
+		// mapping of exactly our scratchpad. Touching it makes the kernel decide, smaps tells us what we got.
+		if(madvise(ptr->long_state, MEMORY, MADV_HUGEPAGE) == 0)
+		{
+			ptr->long_state[0] = 0;
+			if(cryptonight_thp_bytes(ptr->long_state) >= MEMORY)
+				ptr->ctx_info[5] = CTX_PAGES_THP;
+		}
+#endif
 		return ptr;
 	}
 
@@ -139,6 +336,7 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
 	else
 	{
 		ptr->ctx_info[0] = 1;
+		ptr->ctx_info[5] = CTX_PAGES_2MB;
 		return ptr;
 	}
 #else
@@ -162,6 +360,7 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
 	}
 
 	ptr->ctx_info[0] = 1;
+	ptr->ctx_info[5] = CTX_PAGES_2MB;
 
 	if(madvise(ptr->long_state, MEMORY, MADV_RANDOM|MADV_WILLNEED) != 0)
 		msg->warning = "madvise failed";
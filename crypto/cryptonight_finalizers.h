@@ -0,0 +1,570 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __GNUC__
+#include <x86intrin.h>
+#else
+#include <intrin.h>
+#endif // __GNUC__
+
+// BLAKE-256, Groestl-256, JH-256 and Skein-512-256 for the last step of the hash, included by
+// cryptonight_aesni.h into every kernel translation unit. They give the same digest as the C code
+// behind extra_hashes[] for any length, the kernels only ever feed them the 200 byte Keccak state.
+//   BLAKE-256     one row of the state per register, SSE2 (SSSE3 byte shuffles for the 16 and 8 bit rotations)
+//   Groestl-256   P and Q side by side, SubBytes with AESENCLAST, needs AES-NI and SSSE3
+//   JH-256        the bitsliced state of c_jh.c with both 64-bit halves of a row in one register, SSE2
+//   Skein-512-256 Threefish with the rotations and key schedule indices as constants, plain 64-bit code.
+//                 The 4 MIX of a round are independent and fill the integer ports, with 4 lanes of
+//                 AVX2 every round would wait for two cross-lane permutes.
+
+extern "C"
+{
+	extern const unsigned char JH256_H0[128];
+	extern const unsigned char E8_bitslice_roundconstant[42][32];
+}
+
+namespace
+{
+
+static inline uint32_t cn_load_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void cn_store_be64(uint8_t* p, uint64_t v)
+{
+	for(size_t i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (56 - 8 * i));
+}
+
+/*
+ * BLAKE-256
+ */
+
+static const uint8_t cn_blake_sigma[10][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15},
+	{14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3},
+	{11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4},
+	{ 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8},
+	{ 9, 0, 5, 7, 2, 4,10,15,14, 1,11,12, 6, 8, 3,13},
+	{ 2,12, 6,10, 0,11, 8, 3, 4,13, 7, 5,15,14, 1, 9},
+	{12, 5, 1,15,14,13, 4,10, 0, 7, 6, 3, 9, 2, 8,11},
+	{13,11, 7,14,12, 1, 3, 9, 5, 0,15, 4, 8, 6, 2,10},
+	{ 6,15,14, 9,11, 3, 0, 8,12, 2,13, 7, 1, 4,10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5,15,11, 9,14, 3,12,13, 0}
+};
+
+static const uint32_t cn_blake_cst[16] = {
+	0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344,
+	0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89,
+	0x452821E6, 0x38D01377, 0xBE5466CF, 0x34E90C6C,
+	0xC0AC29B7, 0xC97C50DD, 0x3F84D5B5, 0xB5470917
+};
+
+template<int N>
+static inline __m128i cn_rotr32(__m128i x)
+{
+#ifdef __SSSE3__
+	if(N == 16)
+		return _mm_shuffle_epi8(x, _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+	if(N == 8)
+		return _mm_shuffle_epi8(x, _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+#endif
+	return _mm_or_si128(_mm_srli_epi32(x, N), _mm_slli_epi32(x, 32 - N));
+}
+
+// G on all four columns (or diagonals) at once, m0 and m1 hold the message words of the two halves
+static inline void cn_blake_g(__m128i& a, __m128i& b, __m128i& c, __m128i& d, __m128i m0, __m128i m1)
+{
+	a = _mm_add_epi32(a, _mm_add_epi32(m0, b));
+	d = cn_rotr32<16>(_mm_xor_si128(d, a));
+	c = _mm_add_epi32(c, d);
+	b = cn_rotr32<12>(_mm_xor_si128(b, c));
+	a = _mm_add_epi32(a, _mm_add_epi32(m1, b));
+	d = cn_rotr32<8>(_mm_xor_si128(d, a));
+	c = _mm_add_epi32(c, d);
+	b = cn_rotr32<7>(_mm_xor_si128(b, c));
+}
+
+// Message words of G number e .. e + 6 (step 2) for the four lanes
+static inline void cn_blake_msg(const uint32_t* m, const uint8_t* s, __m128i& m0, __m128i& m1)
+{
+	m0 = _mm_set_epi32(m[s[6]] ^ cn_blake_cst[s[7]], m[s[4]] ^ cn_blake_cst[s[5]],
+		m[s[2]] ^ cn_blake_cst[s[3]], m[s[0]] ^ cn_blake_cst[s[1]]);
+	m1 = _mm_set_epi32(m[s[7]] ^ cn_blake_cst[s[6]], m[s[5]] ^ cn_blake_cst[s[4]],
+		m[s[3]] ^ cn_blake_cst[s[2]], m[s[1]] ^ cn_blake_cst[s[0]]);
+}
+
+// t is the number of message bits up to and including this block, nullt leaves it out (no salt)
+static inline void cn_blake256_compress(__m128i* h, const uint8_t* block, uint64_t t, bool nullt)
+{
+	uint32_t m[16];
+	for(size_t i = 0; i < 16; i++)
+		m[i] = cn_load_be32(block + 4 * i);
+
+	__m128i a = h[0];
+	__m128i b = h[1];
+	__m128i c = _mm_loadu_si128((const __m128i*)cn_blake_cst);
+	__m128i d = _mm_loadu_si128((const __m128i*)(cn_blake_cst + 4));
+	if(!nullt)
+		d = _mm_xor_si128(d, _mm_set_epi32((uint32_t)(t >> 32), (uint32_t)(t >> 32), (uint32_t)t, (uint32_t)t));
+
+	for(size_t r = 0; r < 14; r++)
+	{
+		const uint8_t* s = cn_blake_sigma[r % 10];
+		__m128i m0, m1;
+
+		cn_blake_msg(m, s, m0, m1);
+		cn_blake_g(a, b, c, d, m0, m1);
+
+		// Rotate rows 1 - 3 so the diagonals line up as columns
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+		c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+
+		cn_blake_msg(m, s + 8, m0, m1);
+		cn_blake_g(a, b, c, d, m0, m1);
+
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+		c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	h[0] = _mm_xor_si128(h[0], _mm_xor_si128(a, c));
+	h[1] = _mm_xor_si128(h[1], _mm_xor_si128(b, d));
+}
+
+static inline void cn_blake256(const void* input, size_t len, char* output)
+{
+	const uint8_t* in = (const uint8_t*)input;
+	__m128i h[2] = {
+		_mm_set_epi32(0xA54FF53A, 0x3C6EF372, 0xBB67AE85, 0x6A09E667),
+		_mm_set_epi32(0x5BE0CD19, 0x1F83D9AB, 0x9B05688C, 0x510E527F)
+	};
+
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+		cn_blake256_compress(h, in + i, (uint64_t)(i + 64) * 8, false);
+
+	// Padding as in blake256_final: 0x80 after the message, 0x01 in byte 55 and the bit length at the end.
+	// A block with no message bits at all is compressed without the counter.
+	const size_t rem = len - i;
+	const uint64_t bits = (uint64_t)len * 8;
+	uint8_t block[64] = {};
+	memcpy(block, in + i, rem);
+	block[rem] = 0x80;
+	if(rem > 55)
+	{
+		cn_blake256_compress(h, block, bits, false);
+		memset(block, 0, sizeof(block));
+	}
+	block[55] |= 0x01;
+	cn_store_be64(block + 56, bits);
+	cn_blake256_compress(h, block, bits, rem == 0 || rem > 55);
+
+	uint32_t w[8];
+	_mm_storeu_si128((__m128i*)w, h[0]);
+	_mm_storeu_si128((__m128i*)(w + 4), h[1]);
+	for(size_t j = 0; j < 8; j++)
+	{
+		output[4 * j + 0] = (char)(w[j] >> 24);
+		output[4 * j + 1] = (char)(w[j] >> 16);
+		output[4 * j + 2] = (char)(w[j] >> 8);
+		output[4 * j + 3] = (char)w[j];
+	}
+}
+
+/*
+ * Groestl-256
+ *
+ * Register i holds row i of P (low 8 bytes, byte j is column j) and row i of Q (high 8 bytes).
+ * h only needs its P half and is kept as four row pairs.
+ */
+
+#if defined(__AES__) || defined(_MSC_VER)
+
+static inline __m128i cn_groestl_mul2(__m128i x)
+{
+	const __m128i msb = _mm_cmpgt_epi8(_mm_setzero_si128(), x);
+	return _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(msb, _mm_set1_epi8(0x1b)));
+}
+
+static inline void cn_groestl_rounds(__m128i* x)
+{
+	// ShiftBytes of P (row i by i) and Q (row i by 1, 3, 5, 7, 0, 2, 4, 6) merged with the inverse
+	// of the AES ShiftRows that AESENCLAST does before SubBytes
+	const __m128i shift[8] = {
+		_mm_set_epi8(3, 6, 10, 13, 8, 2, 5, 9, 12, 15, 1, 4, 7, 11, 14, 0),
+		_mm_set_epi8(4, 7, 12, 15, 10, 3, 6, 11, 14, 9, 2, 5, 0, 13, 8, 1),
+		_mm_set_epi8(5, 0, 14, 9, 12, 4, 7, 13, 8, 11, 3, 6, 1, 15, 10, 2),
+		_mm_set_epi8(6, 1, 8, 11, 14, 5, 0, 15, 10, 13, 4, 7, 2, 9, 12, 3),
+		_mm_set_epi8(7, 2, 9, 12, 15, 6, 1, 8, 11, 14, 5, 0, 3, 10, 13, 4),
+		_mm_set_epi8(0, 3, 11, 14, 9, 7, 2, 10, 13, 8, 6, 1, 4, 12, 15, 5),
+		_mm_set_epi8(1, 4, 13, 8, 11, 0, 3, 12, 15, 10, 7, 2, 5, 14, 9, 6),
+		_mm_set_epi8(2, 5, 15, 10, 13, 1, 4, 14, 9, 12, 0, 3, 6, 8, 11, 7)
+	};
+	const __m128i qmask = _mm_set_epi64x(-1, 0);
+
+	for(uint64_t r = 0; r < 10; r++)
+	{
+		const uint64_t rc = r * 0x0101010101010101ULL;
+		x[0] = _mm_xor_si128(x[0], _mm_set_epi64x(-1, 0x7060504030201000ULL ^ rc));
+		for(size_t i = 1; i < 7; i++)
+			x[i] = _mm_xor_si128(x[i], qmask);
+		x[7] = _mm_xor_si128(x[7], _mm_set_epi64x(0x8f9fafbfcfdfefffULL ^ rc, 0));
+
+		__m128i a[8];
+		for(size_t i = 0; i < 8; i++)
+			a[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(x[i], shift[i]), _mm_setzero_si128());
+
+		// MixBytes, row i gets 2 2 3 4 5 3 5 7 times rows i .. i + 7, split by the bits of the factors
+		for(size_t i = 0; i < 8; i++)
+		{
+			__m128i b0 = _mm_xor_si128(_mm_xor_si128(a[(i + 2) & 7], a[(i + 4) & 7]),
+				_mm_xor_si128(_mm_xor_si128(a[(i + 5) & 7], a[(i + 6) & 7]), a[(i + 7) & 7]));
+			__m128i b1 = _mm_xor_si128(_mm_xor_si128(a[i], a[(i + 1) & 7]),
+				_mm_xor_si128(_mm_xor_si128(a[(i + 2) & 7], a[(i + 5) & 7]), a[(i + 7) & 7]));
+			__m128i b2 = _mm_xor_si128(_mm_xor_si128(a[(i + 3) & 7], a[(i + 4) & 7]),
+				_mm_xor_si128(a[(i + 6) & 7], a[(i + 7) & 7]));
+			x[i] = _mm_xor_si128(b0, cn_groestl_mul2(_mm_xor_si128(b1, cn_groestl_mul2(b2))));
+		}
+	}
+}
+
+// Message bytes go into the state column by column, the block is transposed into four row pairs
+static inline void cn_groestl_rows(const uint8_t* block, __m128i* rows)
+{
+	const __m128i interleave = _mm_set_epi8(15, 7, 14, 6, 13, 5, 12, 4, 11, 3, 10, 2, 9, 1, 8, 0);
+	__m128i c01 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)block), interleave);
+	__m128i c23 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), interleave);
+	__m128i c45 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), interleave);
+	__m128i c67 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), interleave);
+
+	__m128i r03lo = _mm_unpacklo_epi16(c01, c23);
+	__m128i r47lo = _mm_unpackhi_epi16(c01, c23);
+	__m128i r03hi = _mm_unpacklo_epi16(c45, c67);
+	__m128i r47hi = _mm_unpackhi_epi16(c45, c67);
+
+	rows[0] = _mm_unpacklo_epi32(r03lo, r03hi);
+	rows[1] = _mm_unpackhi_epi32(r03lo, r03hi);
+	rows[2] = _mm_unpacklo_epi32(r47lo, r47hi);
+	rows[3] = _mm_unpackhi_epi32(r47lo, r47hi);
+}
+
+// h = P(h ^ m) ^ Q(m) ^ h
+static inline void cn_groestl_compress(__m128i* h, const uint8_t* block)
+{
+	__m128i m[4], x[8];
+	cn_groestl_rows(block, m);
+	for(size_t i = 0; i < 4; i++)
+	{
+		__m128i t = _mm_xor_si128(h[i], m[i]);
+		x[2 * i] = _mm_unpacklo_epi64(t, m[i]);
+		x[2 * i + 1] = _mm_unpackhi_epi64(t, m[i]);
+	}
+
+	cn_groestl_rounds(x);
+
+	for(size_t i = 0; i < 4; i++)
+	{
+		__m128i p = _mm_unpacklo_epi64(x[2 * i], x[2 * i + 1]);
+		__m128i q = _mm_unpackhi_epi64(x[2 * i], x[2 * i + 1]);
+		h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p, q));
+	}
+}
+
+static inline void cn_groestl256(const void* input, size_t len, char* output)
+{
+	const uint8_t* in = (const uint8_t*)input;
+	// The IV is the digest size in bits in the last two bytes, byte 62 is row 6, column 7
+	__m128i h[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_set_epi64x(0, 0x0100000000000000ULL) };
+
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+		cn_groestl_compress(h, in + i);
+
+	// 0x80 after the message, the number of blocks including the padding in the last 8 bytes
+	const size_t rem = len - i;
+	uint64_t blocks = len / 64 + 1;
+	uint8_t block[64] = {};
+	memcpy(block, in + i, rem);
+	block[rem] = 0x80;
+	if(rem >= 56)
+	{
+		cn_groestl_compress(h, block);
+		memset(block, 0, sizeof(block));
+		blocks++;
+	}
+	cn_store_be64(block + 56, blocks);
+	cn_groestl_compress(h, block);
+
+	// Output transformation P(h) ^ h, both halves run P's rounds on h and only the low one is used
+	__m128i x[8];
+	for(size_t j = 0; j < 4; j++)
+	{
+		x[2 * j] = _mm_unpacklo_epi64(h[j], h[j]);
+		x[2 * j + 1] = _mm_unpackhi_epi64(h[j], h[j]);
+	}
+
+	cn_groestl_rounds(x);
+
+	uint8_t state[64];
+	for(size_t j = 0; j < 4; j++)
+		_mm_storeu_si128((__m128i*)(state + 16 * j), _mm_xor_si128(h[j], _mm_unpacklo_epi64(x[2 * j], x[2 * j + 1])));
+
+	// The digest is columns 4 - 7, row 0 to 7 each
+	for(size_t k = 0; k < 32; k++)
+		output[k] = (char)state[8 * (k & 7) + 4 + k / 8];
+}
+
+#endif // __AES__ || _MSC_VER
+
+/*
+ * JH-256
+ *
+ * x[i] holds x[i][0] (low) and x[i][1] (high) of the bitsliced state in c_jh.c, so the two
+ * iterations of each round there are done at once.
+ */
+
+static inline void cn_jh_sbox(__m128i& m0, __m128i& m1, __m128i& m2, __m128i& m3, __m128i cc)
+{
+	m3 = _mm_xor_si128(m3, _mm_set1_epi32(-1));
+	m0 = _mm_xor_si128(m0, _mm_andnot_si128(m2, cc));
+	__m128i t = _mm_xor_si128(cc, _mm_and_si128(m0, m1));
+	m0 = _mm_xor_si128(m0, _mm_and_si128(m2, m3));
+	m3 = _mm_xor_si128(m3, _mm_andnot_si128(m1, m2));
+	m1 = _mm_xor_si128(m1, _mm_and_si128(m0, m2));
+	m2 = _mm_xor_si128(m2, _mm_andnot_si128(m3, m0));
+	m0 = _mm_xor_si128(m0, _mm_or_si128(m1, m3));
+	m3 = _mm_xor_si128(m3, _mm_and_si128(m1, m2));
+	m1 = _mm_xor_si128(m1, _mm_and_si128(t, m0));
+	m2 = _mm_xor_si128(m2, t);
+}
+
+static inline __m128i cn_jh_swap_bits(__m128i x, int n, __m128i mask)
+{
+	return _mm_or_si128(_mm_slli_epi64(_mm_and_si128(x, mask), n), _mm_srli_epi64(_mm_andnot_si128(mask, x), n));
+}
+
+// Swapping layer of round S of every 7
+template<size_t S>
+static inline __m128i cn_jh_swap(__m128i x)
+{
+	switch(S)
+	{
+	case 0:
+		return cn_jh_swap_bits(x, 1, _mm_set1_epi8(0x55));
+	case 1:
+		return cn_jh_swap_bits(x, 2, _mm_set1_epi8(0x33));
+	case 2:
+		return cn_jh_swap_bits(x, 4, _mm_set1_epi8(0x0f));
+	case 3:
+		return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+	case 4:
+		return _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16));
+	case 5:
+		return _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+	default:
+		return _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+	}
+}
+
+template<size_t S>
+static inline void cn_jh_round(__m128i* x, const unsigned char* rc)
+{
+	// Two Sboxes at once, the even and the odd rows
+	cn_jh_sbox(x[0], x[2], x[4], x[6], _mm_loadu_si128((const __m128i*)rc));
+	cn_jh_sbox(x[1], x[3], x[5], x[7], _mm_loadu_si128((const __m128i*)(rc + 16)));
+
+	// MDS
+	x[1] = _mm_xor_si128(x[1], x[2]);
+	x[3] = _mm_xor_si128(x[3], x[4]);
+	x[5] = _mm_xor_si128(x[5], _mm_xor_si128(x[0], x[6]));
+	x[7] = _mm_xor_si128(x[7], x[0]);
+	x[0] = _mm_xor_si128(x[0], x[3]);
+	x[2] = _mm_xor_si128(x[2], x[5]);
+	x[4] = _mm_xor_si128(x[4], _mm_xor_si128(x[1], x[7]));
+	x[6] = _mm_xor_si128(x[6], x[1]);
+
+	x[1] = cn_jh_swap<S>(x[1]);
+	x[3] = cn_jh_swap<S>(x[3]);
+	x[5] = cn_jh_swap<S>(x[5]);
+	x[7] = cn_jh_swap<S>(x[7]);
+}
+
+static inline void cn_jh_f8(__m128i* x, const uint8_t* block)
+{
+	__m128i m[4];
+	for(size_t i = 0; i < 4; i++)
+	{
+		m[i] = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+		x[i] = _mm_xor_si128(x[i], m[i]);
+	}
+
+	for(size_t r = 0; r < 42; r += 7)
+	{
+		cn_jh_round<0>(x, E8_bitslice_roundconstant[r]);
+		cn_jh_round<1>(x, E8_bitslice_roundconstant[r + 1]);
+		cn_jh_round<2>(x, E8_bitslice_roundconstant[r + 2]);
+		cn_jh_round<3>(x, E8_bitslice_roundconstant[r + 3]);
+		cn_jh_round<4>(x, E8_bitslice_roundconstant[r + 4]);
+		cn_jh_round<5>(x, E8_bitslice_roundconstant[r + 5]);
+		cn_jh_round<6>(x, E8_bitslice_roundconstant[r + 6]);
+	}
+
+	for(size_t i = 0; i < 4; i++)
+		x[i + 4] = _mm_xor_si128(x[i + 4], m[i]);
+}
+
+static inline void cn_jh256(const void* input, size_t len, char* output)
+{
+	const uint8_t* in = (const uint8_t*)input;
+	__m128i x[8];
+	for(size_t i = 0; i < 8; i++)
+		x[i] = _mm_loadu_si128((const __m128i*)(JH256_H0 + 16 * i));
+
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+		cn_jh_f8(x, in + i);
+
+	// A partial block gets 0x80 after the message and the bit length follows in a block of its own,
+	// without a partial block the 0x80 and the length share one
+	const size_t rem = len - i;
+	uint8_t block[64] = {};
+	if(rem != 0)
+	{
+		memcpy(block, in + i, rem);
+		block[rem] = 0x80;
+		cn_jh_f8(x, block);
+		memset(block, 0, sizeof(block));
+	}
+	else
+		block[0] = 0x80;
+	cn_store_be64(block + 56, (uint64_t)len * 8);
+	cn_jh_f8(x, block);
+
+	_mm_storeu_si128((__m128i*)output, x[6]);
+	_mm_storeu_si128((__m128i*)(output + 16), x[7]);
+}
+
+/*
+ * Skein-512-256
+ */
+
+static inline void cn_skein_mix(uint64_t& a, uint64_t& b, int rot)
+{
+	a += b;
+	b = ((b << rot) | (b >> (64 - rot))) ^ a;
+}
+
+template<size_t S>
+static inline void cn_skein_inject(uint64_t* x, const uint64_t* ks, const uint64_t* ts)
+{
+	x[0] += ks[(S + 1) % 9];
+	x[1] += ks[(S + 2) % 9];
+	x[2] += ks[(S + 3) % 9];
+	x[3] += ks[(S + 4) % 9];
+	x[4] += ks[(S + 5) % 9];
+	x[5] += ks[(S + 6) % 9] + ts[(S + 1) % 3];
+	x[6] += ks[(S + 7) % 9] + ts[(S + 2) % 3];
+	x[7] += ks[(S + 8) % 9] + S + 1;
+}
+
+template<size_t R>
+static inline void cn_skein_8_rounds(uint64_t* x, const uint64_t* ks, const uint64_t* ts)
+{
+	cn_skein_mix(x[0], x[1], 46); cn_skein_mix(x[2], x[3], 36); cn_skein_mix(x[4], x[5], 19); cn_skein_mix(x[6], x[7], 37);
+	cn_skein_mix(x[2], x[1], 33); cn_skein_mix(x[4], x[7], 27); cn_skein_mix(x[6], x[5], 14); cn_skein_mix(x[0], x[3], 42);
+	cn_skein_mix(x[4], x[1], 17); cn_skein_mix(x[6], x[3], 49); cn_skein_mix(x[0], x[5], 36); cn_skein_mix(x[2], x[7], 39);
+	cn_skein_mix(x[6], x[1], 44); cn_skein_mix(x[0], x[7],  9); cn_skein_mix(x[2], x[5], 54); cn_skein_mix(x[4], x[3], 56);
+	cn_skein_inject<2 * R>(x, ks, ts);
+	cn_skein_mix(x[0], x[1], 39); cn_skein_mix(x[2], x[3], 30); cn_skein_mix(x[4], x[5], 34); cn_skein_mix(x[6], x[7], 24);
+	cn_skein_mix(x[2], x[1], 13); cn_skein_mix(x[4], x[7], 50); cn_skein_mix(x[6], x[5], 10); cn_skein_mix(x[0], x[3], 17);
+	cn_skein_mix(x[4], x[1], 25); cn_skein_mix(x[6], x[3], 29); cn_skein_mix(x[0], x[5], 39); cn_skein_mix(x[2], x[7], 43);
+	cn_skein_mix(x[6], x[1],  8); cn_skein_mix(x[0], x[7], 35); cn_skein_mix(x[2], x[5], 56); cn_skein_mix(x[4], x[3], 22);
+	cn_skein_inject<2 * R + 1>(x, ks, ts);
+}
+
+// One UBI block, Threefish-512 keyed with h and the tweak t0, t1 plus the feed forward of the block
+static inline void cn_skein_block(uint64_t* h, const uint8_t* block, uint64_t t0, uint64_t t1)
+{
+	uint64_t w[8], x[8], ks[9], ts[3];
+	memcpy(w, block, sizeof(w));
+
+	ks[8] = 0x1BD11BDAA9FC1A22ULL;
+	for(size_t i = 0; i < 8; i++)
+	{
+		ks[i] = h[i];
+		ks[8] ^= h[i];
+		x[i] = w[i] + h[i];
+	}
+	ts[0] = t0;
+	ts[1] = t1;
+	ts[2] = t0 ^ t1;
+	x[5] += t0;
+	x[6] += t1;
+
+	cn_skein_8_rounds<0>(x, ks, ts);
+	cn_skein_8_rounds<1>(x, ks, ts);
+	cn_skein_8_rounds<2>(x, ks, ts);
+	cn_skein_8_rounds<3>(x, ks, ts);
+	cn_skein_8_rounds<4>(x, ks, ts);
+	cn_skein_8_rounds<5>(x, ks, ts);
+	cn_skein_8_rounds<6>(x, ks, ts);
+	cn_skein_8_rounds<7>(x, ks, ts);
+	cn_skein_8_rounds<8>(x, ks, ts);
+
+	for(size_t i = 0; i < 8; i++)
+		h[i] = x[i] ^ w[i];
+}
+
+static inline void cn_skein512_256(const void* input, size_t len, char* output)
+{
+	const uint8_t* in = (const uint8_t*)input;
+	// Chaining value after the configuration block for 256 bit output (SKEIN_512_IV_256)
+	uint64_t h[8] = {
+		0xCCD044A12FDB3E13ULL, 0xE83590301A79A9EBULL, 0x55AEA0614F816E6FULL, 0x2A2767A4AE9B94DBULL,
+		0xEC06025E74DD7683ULL, 0xE7A436CDC4746251ULL, 0xC36FBAF9393AD185ULL, 0x3EEDBA1833EDFC13ULL
+	};
+	const uint64_t T1_FIRST = 1ULL << 62;
+	const uint64_t T1_FINAL = 1ULL << 63;
+	const uint64_t T1_MSG = 48ULL << 56;
+	const uint64_t T1_OUT = 63ULL << 56;
+
+	// The last block is always held back for the final flag, even when it is a full one
+	uint64_t t1 = T1_FIRST | T1_MSG;
+	size_t i = 0;
+	for(; i + 64 < len; i += 64)
+	{
+		cn_skein_block(h, in + i, i + 64, t1);
+		t1 = T1_MSG;
+	}
+
+	uint8_t block[64] = {};
+	memcpy(block, in + i, len - i);
+	cn_skein_block(h, block, len, t1 | T1_FINAL);
+
+	// Output stage, counter 0 in a block of its own
+	memset(block, 0, sizeof(block));
+	cn_skein_block(h, block, 8, T1_FIRST | T1_FINAL | T1_OUT);
+	memcpy(output, h, 32);
+}
+
+} // namespace
@@ -0,0 +1,87 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  */
+#pragma once
+
+#include "cryptonight.h"
+#include <stddef.h>
+
+typedef void (*cn_hash_fun)(const void*, size_t, void*, cryptonight_ctx**);
+
+// Instruction set levels we build the hash kernels for. Each level lives in its own
+// translation unit compiled with the matching flags, higher levels include the lower ones.
+enum cn_isa
+{
+	cn_isa_soft,   // SSE2 with software AES
+	cn_isa_aes,    // AES-NI
+	cn_isa_avx2,   // AES-NI, VEX encoding, AVX2 and BMI2 (mulx)
+	cn_isa_vaes,   // as above plus 256-bit AES for explode and implode
+	cn_isa_avx512, // as above plus 512-bit AES for explode and implode
+	cn_isa_count
+};
+
+constexpr size_t CN_MAX_N = 8;
+
+// The three phases of a single hash, used to benchmark them separately.
+// keccak has to be run on hash_state before explode.
+// keccak and keccakf are the ones the multiway kernels run on all N lanes at once, keccak
+// reads input + len * i into ctx[i]->hash_state, keccakf permutes hash_state in place.
+// extra_hash is the final hash the kernels pick by the first byte of the state, like extra_hashes[].
+typedef void (*cn_phase_fun)(cryptonight_ctx*);
+typedef void (*cn_keccak_fun)(const void* input, size_t len, cryptonight_ctx** ctx, size_t N);
+typedef void (*cn_keccakf_fun)(cryptonight_ctx** ctx, size_t N);
+typedef void (*cn_extra_hash_fun)(const void* state, size_t len, char* output);
+struct cn_phase_funs
+{
+	cn_phase_fun explode;
+	cn_phase_fun main_loop;
+	cn_phase_fun implode;
+	cn_keccak_fun keccak;
+	cn_keccakf_fun keccakf;
+	cn_extra_hash_fun extra_hash;
+};
+
+// Per translation unit kernel tables, return nullptr if the compiler couldn't build that level
+cn_hash_fun cn_kernels_soft(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_kernels_aes(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_kernels_avx2(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_kernels_vaes(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_kernels_avx512(size_t N, bool bNoPrefetch);
+
+cn_phase_funs cn_phases_soft(bool bNoPrefetch);
+cn_phase_funs cn_phases_aes(bool bNoPrefetch);
+cn_phase_funs cn_phases_avx2(bool bNoPrefetch);
+cn_phase_funs cn_phases_vaes(bool bNoPrefetch);
+cn_phase_funs cn_phases_avx512(bool bNoPrefetch);
+
+// Pipelined multiway kernels (2 or more lanes, nullptr otherwise), see cryptonight_pipe_hash
+cn_hash_fun cn_pipe_kernels_soft(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_pipe_kernels_aes(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_pipe_kernels_avx2(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_pipe_kernels_vaes(size_t N, bool bNoPrefetch);
+cn_hash_fun cn_pipe_kernels_avx512(size_t N, bool bNoPrefetch);
+
+// Returns the kernel for the requested level, or the best lower level that was compiled in
+cn_hash_fun cn_select_kernel(cn_isa isa, size_t N, bool bNoPrefetch);
+cn_hash_fun cn_select_pipe_kernel(cn_isa isa, size_t N, bool bNoPrefetch);
+cn_phase_funs cn_select_phases(cn_isa isa, bool bNoPrefetch);
+cn_isa cn_compiled_isa(cn_isa isa);
+// Compares the lane-parallel Keccak of that level with c_keccak.c on 1 to CN_MAX_N lanes with a
+// different input in every lane. Overwrites hash_state of the CN_MAX_N contexts.
+bool cn_keccak_self_test(cn_isa isa, cryptonight_ctx** ctx);
+// Compares the BLAKE, Groestl, JH and Skein of that level with extra_hashes[] on lengths that
+// cover every padding case
+bool cn_extra_hash_self_test(cn_isa isa);
+const char* cn_isa_name(cn_isa isa);
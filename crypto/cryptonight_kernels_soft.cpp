@@ -0,0 +1,33 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  */
+
+// Baseline kernels, this file must be compiled without any ISA flags beyond SSE2
+#include "cryptonight_aesni.h"
+
+cn_hash_fun cn_kernels_soft(size_t N, bool bNoPrefetch)
+{
+	return cn_kernel_table<true>(N, bNoPrefetch);
+}
+
+cn_phase_funs cn_phases_soft(bool bNoPrefetch)
+{
+	return cn_phase_table<true>(bNoPrefetch);
+}
+
+cn_hash_fun cn_pipe_kernels_soft(size_t N, bool bNoPrefetch)
+{
+	return cn_pipe_kernel_table<true>(N, bNoPrefetch);
+}
@@ -0,0 +1,53 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  */
+
+// Compiled with -maes -mssse3 -mavx2 -mbmi2 -mvaes (/arch:AVX2 on MSVC)
+#include "cryptonight_kernels.h"
+
+#if defined(__VAES__) || (defined(_MSC_VER) && _MSC_VER >= 1920 && defined(__AVX2__))
+#define CN_KERNEL_VAES
+#include "cryptonight_aesni.h"
+
+cn_hash_fun cn_kernels_vaes(size_t N, bool bNoPrefetch)
+{
+	return cn_kernel_table<false>(N, bNoPrefetch);
+}
+
+cn_phase_funs cn_phases_vaes(bool bNoPrefetch)
+{
+	return cn_phase_table<false>(bNoPrefetch);
+}
+
+cn_hash_fun cn_pipe_kernels_vaes(size_t N, bool bNoPrefetch)
+{
+	return cn_pipe_kernel_table<false>(N, bNoPrefetch);
+}
+#else
+cn_hash_fun cn_kernels_vaes(size_t N, bool bNoPrefetch)
+{
+	return nullptr;
+}
+
+cn_phase_funs cn_phases_vaes(bool bNoPrefetch)
+{
+	return cn_phase_funs{ nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
+}
+
+cn_hash_fun cn_pipe_kernels_vaes(size_t N, bool bNoPrefetch)
+{
+	return nullptr;
+}
+#endif // __VAES__
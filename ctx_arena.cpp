@@ -0,0 +1,596 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "ctx_arena.h"
+#include "console.h"
+#include "topology.h"
+#include "crypto/cryptonight_kernels.h"
+
+#ifdef __GNUC__
+#include <mm_malloc.h>
+#else
+#include <malloc.h>
+#endif // __GNUC__
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+ctx_arena* ctx_arena::oInst = nullptr;
+
+ctx_arena::ctx_arena()
+{
+}
+
+ctx_arena::node_pool* ctx_arena::find_pool(int64_t iNode, size_t* pIdx)
+{
+	for(size_t i=0; i < vPools.size(); i++)
+	{
+		if(vPools[i].iNode == iNode)
+		{
+			if(pIdx != nullptr)
+				*pIdx = i;
+			return &vPools[i];
+		}
+	}
+	return nullptr;
+}
+
+int64_t ctx_arena::cpu_pool_node(int64_t iCpuAff)
+{
+	if(iCpuAff < 0)
+		return -1;
+
+	// Without a topology the node is unknown, keep those threads apart from the unpinned ones
+	int64_t iNode = topology::inst()->pu_node(iCpuAff);
+	return iNode >= 0 ? iNode : 0;
+}
+
+void ctx_arena::pool_name(int64_t iNode, char* sBuf, size_t iLen)
+{
+	if(iNode >= 0)
+		snprintf(sBuf, iLen, "NUMA node %d", (int)iNode);
+	else
+		snprintf(sBuf, iLen, "Threads without affinity");
+}
+
+void ctx_arena::need_by_node(const std::vector<jconf::thd_cfg>& vCfg, std::vector<node_need>& vNeed)
+{
+	vNeed.clear();
+	for(const jconf::thd_cfg& cfg : vCfg)
+	{
+		int64_t iNode = cpu_pool_node(cfg.iCpuAff);
+
+		size_t i;
+		for(i=0; i < vNeed.size(); i++)
+		{
+			if(vNeed[i].iNode == iNode)
+				break;
+		}
+
+		if(i == vNeed.size())
+			vNeed.push_back({iNode, cfg.iCpuAff, 0});
+		vNeed[i].iPads += cfg.iMultiway;
+	}
+}
+
+ctx_arena::node_pool* ctx_arena::get_pool(int64_t iNode, size_t* pIdx)
+{
+	node_pool* pool = find_pool(iNode, pIdx);
+	if(pool == nullptr)
+	{
+		vPools.push_back({iNode, std::vector<pad>(), CTX_PAGES_1GB});
+		pool = &vPools.back();
+		if(pIdx != nullptr)
+			*pIdx = vPools.size() - 1;
+	}
+	return pool;
+}
+
+#if defined(__linux__)
+static long read_sysfs(const char* sPath)
+{
+	FILE* f = fopen(sPath, "r");
+	if(f == nullptr)
+		return -1;
+
+	long iVal;
+	if(fscanf(f, "%ld", &iVal) != 1)
+		iVal = -1;
+	fclose(f);
+	return iVal;
+}
+
+static bool write_sysfs(const char* sPath, long iVal)
+{
+	FILE* f = fopen(sPath, "w");
+	if(f == nullptr)
+		return false;
+
+	bool bOk = fprintf(f, "%ld\n", iVal) > 0;
+	return fclose(f) == 0 && bOk;
+}
+
+// Per node counters if the kernel has them, the system wide ones otherwise
+static void hugepage_path(char* sBuf, size_t iLen, int64_t iNode, size_t iPageKb, const char* sFile)
+{
+	if(iNode >= 0)
+	{
+		snprintf(sBuf, iLen, "/sys/devices/system/node/node%d/hugepages/hugepages-%ukB/%s", (int)iNode, (unsigned)iPageKb, sFile);
+		if(access(sBuf, F_OK) == 0)
+			return;
+	}
+	snprintf(sBuf, iLen, "/sys/kernel/mm/hugepages/hugepages-%ukB/%s", (unsigned)iPageKb, sFile);
+}
+#endif
+
+bool ctx_arena::check_hugepages(const char* sPool, int64_t iNode, size_t iPageKb, size_t iNeeded)
+{
+#if defined(__linux__)
+	char sFree[128], sNr[128];
+	hugepage_path(sFree, sizeof(sFree), iNode, iPageKb, "free_hugepages");
+	hugepage_path(sNr, sizeof(sNr), iNode, iPageKb, "nr_hugepages");
+
+	long iFree = read_sysfs(sFree);
+	if(iFree < 0)
+		return false; // The kernel doesn't offer this page size
+
+	if((size_t)iFree >= iNeeded)
+		return true;
+
+	long iNr = read_sysfs(sNr);
+	long iWant = iNr + (long)(iNeeded - iFree);
+
+	// Only works as root, the kernel may also give us fewer pages than we asked for
+	if(iNr >= 0 && access(sNr, W_OK) == 0 && write_sysfs(sNr, iWant))
+	{
+		iFree = read_sysfs(sFree);
+		if(iFree >= 0 && (size_t)iFree >= iNeeded)
+		{
+			printer::inst()->print_msg(L0, "%s: raised nr_hugepages (%u kB pages) to %ld.", sPool, (unsigned)iPageKb, iWant);
+			return true;
+		}
+	}
+
+	printer::inst()->print_msg(L0, "%s: %ld of the %u needed %u kB huge pages are free. To reserve them run \"echo %ld > %s\" as root.",
+		sPool, iFree, (unsigned)iNeeded, (unsigned)iPageKb, iWant, sNr);
+	return false;
+#else
+	return false;
+#endif
+}
+
+bool ctx_arena::plan()
+{
+#if defined(__linux__)
+	jconf::slow_mem_cfg mem = jconf::inst()->GetSlowMemSetting();
+	if(mem == jconf::always_use)
+		return true;
+
+	std::vector<jconf::thd_cfg> vCfg(jconf::inst()->GetThreadCount());
+	for(size_t i=0; i < vCfg.size(); i++)
+		jconf::inst()->GetThreadConfig(i, vCfg[i]);
+
+	std::lock_guard<std::mutex> lck(mtx);
+
+	std::vector<node_need> vNeed;
+	need_by_node(vCfg, vNeed);
+
+	// The self test runs after us, without affinity, and takes CN_MAX_N scratchpads from the same
+	// free huge pages. The arena keeps them for the threads afterwards, count them as unpinned ones.
+	size_t i;
+	for(i=0; i < vNeed.size(); i++)
+	{
+		if(vNeed[i].iNode < 0)
+			break;
+	}
+
+	if(i == vNeed.size())
+		vNeed.push_back({-1, -1, 0});
+	vNeed[i].iPads += CN_MAX_N;
+
+	// The unpinned threads are checked against the system wide counters, those overlap with the
+	// per node ones - the plan can be optimistic there, the arena still falls back if it has to
+	bool bOk = true;
+	size_t iTotalPads = 0;
+	for(const node_need& need : vNeed)
+	{
+		char sPool[32];
+		pool_name(need.iNode, sPool, sizeof(sPool));
+		node_pool* pool = get_pool(need.iNode);
+		iTotalPads += need.iPads;
+
+		// Nothing is allocated yet, every scratchpad needs new pages
+		size_t iMissing = need.iPads;
+
+		constexpr size_t iGb = 1024 * 1024 * 1024;
+		if(jconf::inst()->Use1GbPages() && check_hugepages(sPool, need.iNode, 1024 * 1024, (iMissing * MEMORY + iGb - 1) / iGb))
+		{
+			pool->iBestPages = CTX_PAGES_1GB;
+			continue;
+		}
+
+		if(check_hugepages(sPool, need.iNode, MEMORY / 1024, iMissing))
+		{
+			pool->iBestPages = CTX_PAGES_2MB;
+			if(jconf::inst()->Use1GbPages())
+				printer::inst()->print_msg(L0, "%s: falling back to 2MB pages.", sPool);
+			continue;
+		}
+
+		if(mem == jconf::print_warning)
+		{
+			// Don't grab the few huge pages there are, all threads of the node should run alike
+			pool->iBestPages = CTX_PAGES_THP;
+			printer::inst()->print_msg(L0, "%s: not enough huge pages, its %u scratchpads will use transparent huge pages or normal memory.",
+				sPool, (unsigned)need.iPads);
+		}
+		else
+		{
+			printer::inst()->print_msg(L0, "%s: not enough huge pages for %u scratchpads and use_slow_memory doesn't allow anything else.",
+				sPool, (unsigned)need.iPads);
+			bOk = false;
+		}
+	}
+
+	rlimit lim;
+	uint64_t iLockBytes = (uint64_t)iTotalPads * MEMORY;
+	if(mem != jconf::no_mlck && geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &lim) == 0 &&
+		lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < iLockBytes)
+	{
+		printer::inst()->print_msg(L0, "The memlock limit of %llu kB is below the %llu kB the scratchpads need, raise \"ulimit -l\" or set use_slow_memory to no_mlck.",
+			int_port(lim.rlim_cur / 1024), int_port(iLockBytes / 1024));
+	}
+
+	if(!bOk)
+		printer::inst()->print_msg(L0, "Not enough huge pages, refusing to start.");
+	return bOk;
+#else
+	return true;
+#endif
+}
+
+void ctx_arena::reserve(const std::vector<jconf::thd_cfg>& vCfg)
+{
+#if defined(__linux__)
+	if(jconf::inst()->GetSlowMemSetting() == jconf::always_use)
+		return;
+
+	std::lock_guard<std::mutex> lck(mtx);
+
+	std::vector<node_need> vNeed;
+	need_by_node(vCfg, vNeed);
+
+	for(const node_need& need : vNeed)
+	{
+		node_pool* pool = get_pool(need.iNode);
+
+		// Scratchpads on smaller pages than this node can get don't count, the threads
+		// take the large ones first and the rest stay spare
+		uint8_t iMinPages = jconf::inst()->Use1GbPages() ? CTX_PAGES_1GB : CTX_PAGES_2MB;
+		if(pool->iBestPages < iMinPages)
+			iMinPages = pool->iBestPages;
+
+		size_t iHave = free_pads(need.iNode, iMinPages);
+		if(iHave < need.iPads)
+			map_pads(*pool, need.iPads - iHave, need.iCpuAff);
+		else
+		{
+			char sPool[32];
+			pool_name(need.iNode, sPool, sizeof(sPool));
+			printer::inst()->print_msg(L2, "%s: reusing %u scratchpads from the arena.", sPool, (unsigned)need.iPads);
+		}
+	}
+#endif
+}
+
+bool ctx_arena::map_pads(node_pool& pool, size_t iPads, int64_t iCpuAff)
+{
+#if defined(__linux__)
+	char sPool[32];
+	pool_name(pool.iNode, sPool, sizeof(sPool));
+
+	size_t iLen;
+	uint8_t iPages;
+	uint8_t* pMem = map_memory(iPads, pool.iBestPages, iLen, iPages);
+
+	if(pMem == nullptr)
+	{
+		printer::inst()->print_msg(L1, "%s: can't map %u large pages for the scratchpad arena, threads will allocate their own.",
+			sPool, (unsigned)iPads);
+		return false;
+	}
+
+	// A 1GB page holds more scratchpads than we asked for, they are there for later threads
+	iPads = iLen / MEMORY;
+
+	// The binding only prefers the node, see topology::bind_area
+	if(pool.iNode >= 0 && !topology::inst()->bind_area(pMem, iLen, iCpuAff))
+		printer::inst()->print_msg(L1, "%s: can't bind the scratchpad arena.", sPool);
+
+	// Fault the pages in now, they land on the node the policy above picks
+	for(size_t i=0; i < iLen; i += MEMORY)
+		pMem[i] = 0;
+
+	madvise(pMem, iLen, MADV_RANDOM);
+
+	// madvise only asks for THP, check what the kernel handed us now that the pages are in
+	if(iPages == CTX_PAGES_THP && cryptonight_thp_bytes(pMem) < iLen)
+		iPages = CTX_PAGES_NORMAL;
+
+	// No point in trying for larger pages again on the next start
+	if(iPages < pool.iBestPages)
+		pool.iBestPages = iPages;
+
+	bool bLocked = false;
+	if(jconf::inst()->GetSlowMemSetting() != jconf::no_mlck)
+	{
+		bLocked = mlock(pMem, iLen) == 0;
+		if(!bLocked && jconf::inst()->GetSlowMemSetting() == jconf::never_use)
+		{
+			printer::inst()->print_msg(L1, "%s: can't lock the scratchpad arena, threads will allocate their own.", sPool);
+			munmap(pMem, iLen);
+			return false;
+		}
+	}
+
+	// move_pages without target nodes only reports where every page is
+	std::vector<void*> vPages(iPads);
+	std::vector<int> vStatus(iPads, -1);
+	for(size_t i=0; i < iPads; i++)
+		vPages[i] = pMem + i * MEMORY;
+
+	if(syscall(SYS_move_pages, 0, iPads, vPages.data(), nullptr, vStatus.data(), 0) != 0)
+		vStatus.assign(iPads, -1);
+
+	size_t iMisplaced = 0;
+	for(size_t i=0; i < iPads; i++)
+	{
+		int iNode = vStatus[i] >= 0 ? vStatus[i] : -1;
+		if(pool.iNode >= 0 && iNode >= 0 && iNode != pool.iNode)
+			iMisplaced++;
+		pool.vFree.push_back({pMem + i * MEMORY, iNode, bLocked, iPages});
+	}
+
+	printer::inst()->print_msg(L1, "%s: %u scratchpads reserved in the arena on %s pages, %u of them on another node.",
+		sPool, (unsigned)iPads, cryptonight_page_name(iPages), (unsigned)iMisplaced);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+uint8_t* ctx_arena::map_memory(size_t iPads, uint8_t iBestPages, size_t& iLen, uint8_t& iPages)
+{
+#if defined(__linux__)
+	uint8_t* pMem;
+	jconf::slow_mem_cfg mem = jconf::inst()->GetSlowMemSetting();
+
+	if(jconf::inst()->Use1GbPages() && iBestPages >= CTX_PAGES_1GB)
+	{
+		constexpr size_t iGb = 1024 * 1024 * 1024;
+		iLen = (iPads * MEMORY + iGb - 1) / iGb * iGb;
+		pMem = (uint8_t*)mmap(0, iLen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+
+		if(pMem != MAP_FAILED)
+		{
+			iPages = CTX_PAGES_1GB;
+			return pMem;
+		}
+	}
+
+	iLen = iPads * MEMORY;
+	if(iBestPages >= CTX_PAGES_2MB)
+	{
+		pMem = (uint8_t*)mmap(0, iLen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if(pMem != MAP_FAILED)
+		{
+			iPages = CTX_PAGES_2MB;
+			return pMem;
+		}
+	}
+
+	// Only "warn" lets us settle for less than real large pages
+	if(mem != jconf::print_warning)
+		return nullptr;
+
+	// Over-map by 2MB so we can cut out a 2MB aligned range, THP can only back aligned memory
+	constexpr size_t iAlign = 2 * 1024 * 1024;
+	uint8_t* pRaw = (uint8_t*)mmap(0, iLen + iAlign, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(pRaw == MAP_FAILED)
+		return nullptr;
+
+	pMem = (uint8_t*)(((uintptr_t)pRaw + iAlign - 1) & ~(uintptr_t)(iAlign - 1));
+	if(pMem != pRaw)
+		munmap(pRaw, pMem - pRaw);
+	if(pMem + iLen != pRaw + iLen + iAlign)
+		munmap(pMem + iLen, (pRaw + iLen + iAlign) - (pMem + iLen));
+
+	iPages = madvise(pMem, iLen, MADV_HUGEPAGE) == 0 ? CTX_PAGES_THP : CTX_PAGES_NORMAL;
+	return pMem;
+#else
+	return nullptr;
+#endif
+}
+
+// Where the kernel put the page holding pMem, -1 if we can't tell
+static int page_node(void* pMem)
+{
+#if defined(__linux__)
+	int iStatus = -1;
+	if(syscall(SYS_move_pages, 0, 1, &pMem, nullptr, &iStatus, 0) != 0)
+		return -1;
+	return iStatus >= 0 ? iStatus : -1;
+#else
+	return -1;
+#endif
+}
+
+// Scratchpads of threads without affinity (and of the self test) are as good as
+// a node's own if they happen to sit on that node
+static bool pad_fits(int iPadNode, int64_t iNode, bool bShared)
+{
+	return !bShared || iPadNode == iNode || iPadNode < 0;
+}
+
+size_t ctx_arena::free_pads(int64_t iNode, uint8_t iMinPages)
+{
+	node_pool* vCand[2] = { find_pool(iNode), iNode >= 0 ? find_pool(-1) : nullptr };
+
+	size_t iCnt = 0;
+	for(size_t c=0; c < 2; c++)
+	{
+		if(vCand[c] == nullptr)
+			continue;
+
+		for(const pad& p : vCand[c]->vFree)
+		{
+			if(p.iPages >= iMinPages && pad_fits(p.iNode, iNode, c == 1))
+				iCnt++;
+		}
+	}
+	return iCnt;
+}
+
+bool ctx_arena::take_pad(int64_t iNode, pad& p)
+{
+	node_pool* vCand[2] = { find_pool(iNode), iNode >= 0 ? find_pool(-1) : nullptr };
+
+	// Largest pages first, the most recently freed (still cache warm) one among equals
+	node_pool* best = nullptr;
+	size_t iBest = 0;
+	for(size_t c=0; c < 2; c++)
+	{
+		if(vCand[c] == nullptr)
+			continue;
+
+		std::vector<pad>& vFree = vCand[c]->vFree;
+		for(size_t i=vFree.size(); i-- > 0; )
+		{
+			if(!pad_fits(vFree[i].iNode, iNode, c == 1))
+				continue;
+			if(best == nullptr || vFree[i].iPages > best->vFree[iBest].iPages)
+			{
+				best = vCand[c];
+				iBest = i;
+			}
+		}
+	}
+
+	if(best == nullptr)
+		return false;
+
+	p = best->vFree[iBest];
+	best->vFree.erase(best->vFree.begin() + iBest);
+	return true;
+}
+
+cryptonight_ctx* ctx_arena::alloc_ctx(int64_t iCpuAff)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+
+	int64_t iNode = cpu_pool_node(iCpuAff);
+
+	pad p;
+	if(!take_pad(iNode, p))
+		return nullptr;
+
+	// Freed it goes to our pool, wherever it came from
+	size_t iPoolIdx;
+	get_pool(iNode, &iPoolIdx);
+
+	cryptonight_ctx* ptr = (cryptonight_ctx*)_mm_malloc(sizeof(cryptonight_ctx), 4096);
+	if(ptr == nullptr)
+	{
+		vPools[iPoolIdx].vFree.push_back(p);
+		return nullptr;
+	}
+
+	memset(ptr->ctx_info, 0, sizeof(ptr->ctx_info));
+	ptr->cancel_epoch = nullptr;
+	ptr->epoch = 0;
+	ptr->cancelled = 0;
+	ptr->long_state = p.pMem;
+	ptr->ctx_info[0] = p.iPages >= CTX_PAGES_2MB ? 1 : 0;
+	ptr->ctx_info[1] = p.bLocked ? 1 : 0;
+	ptr->ctx_info[2] = 1;
+	ptr->ctx_info[3] = (uint8_t)(p.iNode + 1);
+	ptr->ctx_info[4] = (uint8_t)iPoolIdx;
+	ptr->ctx_info[5] = p.iPages;
+
+	if(iNode >= 0 && p.iNode >= 0 && p.iNode != iNode)
+		printer::inst()->print_msg(L1, "WARNING: scratchpad for CPU %d is on NUMA node %d instead of %d.",
+			(int)iCpuAff, p.iNode, (int)iNode);
+
+	return ptr;
+}
+
+bool ctx_arena::free_ctx(cryptonight_ctx* ctx)
+{
+	if(ctx->ctx_info[2] == 0)
+		return false;
+
+	std::lock_guard<std::mutex> lck(mtx);
+
+	assert(ctx->ctx_info[4] < vPools.size());
+	vPools[ctx->ctx_info[4]].vFree.push_back({ctx->long_state, (int)ctx->ctx_info[3] - 1, ctx->ctx_info[1] != 0, ctx->ctx_info[5]});
+	_mm_free(ctx);
+	return true;
+}
+
+void ctx_arena::adopt_ctx(cryptonight_ctx* ctx, int64_t iCpuAff)
+{
+	int iPadNode = page_node(ctx->long_state);
+
+	std::lock_guard<std::mutex> lck(mtx);
+
+	int64_t iNode = cpu_pool_node(iCpuAff);
+
+	size_t iPoolIdx;
+	get_pool(iNode, &iPoolIdx);
+
+	ctx->ctx_info[2] = 1;
+	ctx->ctx_info[3] = (uint8_t)(iPadNode + 1);
+	ctx->ctx_info[4] = (uint8_t)iPoolIdx;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include "crypto/cryptonight.h"
+#include "jconf.h"
+
+/*
+   Scratchpads of all mining threads, reserved before the threads start. Every NUMA node
+   gets one large page mapping bound to it, and the threads pinned to a CPU of that node
+   take their scratchpads from there. The kernel is asked where each page really ended up,
+   a scratchpad on the wrong node is reported when it is handed out.
+
+   Scratchpads go back to the arena when freed, they are never unmapped. A thread that
+   doesn't find one here falls back to cryptonight_alloc_ctx, and that scratchpad is
+   adopted by the arena too. When threads are stopped and started again (autotune, a
+   different thread count) the new ones get the same, already faulted pages.
+*/
+class ctx_arena
+{
+public:
+	static ctx_arena* inst()
+	{
+		if (oInst == nullptr) oInst = new ctx_arena;
+		return oInst;
+	};
+
+	// Checks the free huge pages of every NUMA node against the configured threads before anything
+	// is started, raises nr_hugepages if we are allowed to and decides which page size each node
+	// gets. False if use_slow_memory doesn't allow us to run with what we have.
+	bool plan();
+	// Makes sure the arena has a scratchpad for every hash of every thread in vCfg
+	void reserve(const std::vector<jconf::thd_cfg>& vCfg);
+	// Scratchpad on the NUMA node of iCpuAff (-1 for threads without affinity), nullptr if there is none left
+	cryptonight_ctx* alloc_ctx(int64_t iCpuAff);
+	// Takes the scratchpad back, false if ctx didn't come from the arena
+	bool free_ctx(cryptonight_ctx* ctx);
+	// Makes a scratchpad from cryptonight_alloc_ctx part of the arena, free_ctx keeps it from then on
+	void adopt_ctx(cryptonight_ctx* ctx, int64_t iCpuAff);
+
+private:
+	ctx_arena();
+	static ctx_arena* oInst;
+
+	struct pad
+	{
+		uint8_t* pMem;
+		int iNode; // Where the kernel placed the memory, -1 if we don't know
+		bool bLocked;
+		uint8_t iPages; // CTX_PAGES_*
+	};
+
+	struct node_pool
+	{
+		int64_t iNode; // -1 collects the threads without affinity
+		std::vector<pad> vFree;
+		uint8_t iBestPages; // Largest page size worth trying, set by plan() and lowered by map_pads()
+	};
+
+	struct node_need
+	{
+		int64_t iNode;
+		int64_t iCpuAff; // Any CPU of the node
+		size_t iPads;
+	};
+
+	static int64_t cpu_pool_node(int64_t iCpuAff);
+	static void pool_name(int64_t iNode, char* sBuf, size_t iLen);
+	static void need_by_node(const std::vector<jconf::thd_cfg>& vCfg, std::vector<node_need>& vNeed);
+	bool check_hugepages(const char* sPool, int64_t iNode, size_t iPageKb, size_t iNeeded);
+
+	node_pool* find_pool(int64_t iNode, size_t* pIdx = nullptr);
+	node_pool* get_pool(int64_t iNode, size_t* pIdx = nullptr);
+	size_t free_pads(int64_t iNode, uint8_t iMinPages);
+	bool take_pad(int64_t iNode, pad& p);
+	bool map_pads(node_pool& pool, size_t iPads, int64_t iCpuAff);
+	uint8_t* map_memory(size_t iPads, uint8_t iBestPages, size_t& iLen, uint8_t& iPages);
+
+	std::vector<node_pool> vPools;
+	std::mutex mtx;
+};
@@ -30,6 +30,7 @@
 #include "executor.h"
 #include "jpsock.h"
 #include "minethd.h"
+#include "nonce_alloc.h"
 #include "jconf.h"
 #include "console.h"
 #include "donate-level.h"
@@ -41,7 +42,11 @@
 
 executor* executor::oInst = NULL;
 
-executor::executor()
+// Upper bucket bounds in seconds for the /metrics histograms
+static const double fPoolLatencyBounds[] = { 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 };
+static const double fJobSwitchBounds[] = { 0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1 };
+
+executor::executor() : oPoolLatency(fPoolLatencyBounds), oJobSwitchLatency(fJobSwitchBounds)
 {
 }
 
@@ -239,6 +244,13 @@ void executor::on_pool_have_job(size_t pool_id, pool_job& oPoolJob)
 	if(pool_id == dev_pool_id)
 		return;
 
+	if(oPoolJob.iRecvTime != 0)
+	{
+		using namespace std::chrono;
+		uint64_t iNow = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+		oJobSwitchLatency.add((iNow - oPoolJob.iRecvTime) / 1e9);
+	}
+
 	if(iPoolDiff != pool->get_current_diff())
 	{
 		iPoolDiff = pool->get_current_diff();
@@ -251,12 +263,14 @@ void executor::on_pool_have_job(size_t pool_id, pool_job& oPoolJob)
 void executor::on_miner_result(size_t pool_id, job_result& oResult)
 {
 	jpsock* pool = pick_pool_by_id(pool_id);
+	uint64_t* targets = (uint64_t*)oResult.bResult;
+	uint64_t iResultDiff = jpsock::t64_to_diff(targets[3]);
 
 	if(pool_id == dev_pool_id)
 	{
 		//Ignore errors silently
 		if(pool->is_running() && pool->is_logged_in())
-			pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult);
+			pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult, iResultDiff);
 
 		return;
 	}
@@ -267,39 +281,41 @@ void executor::on_miner_result(size_t pool_id, job_result& oResult)
 		return;
 	}
 
-	using namespace std::chrono;
-	size_t t_start = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
-	bool bResult = pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult);
-	size_t t_len = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count() - t_start;
+	// The pool's answer comes back as EV_POOL_SUBMIT_RESULT, we keep handling jobs in the meantime
+	if(!pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult, iResultDiff))
+		log_result_error("[TOO MANY PENDING SUBMITS]");
+}
 
-	if(t_len > 0xFFFF)
-		t_len = 0xFFFF;
-	iPoolCallTimes.push_back((uint16_t)t_len);
+void executor::on_submit_result(size_t pool_id, submit_result& oRes)
+{
+	if(pool_id == dev_pool_id)
+		return;
 
-	if(bResult)
+	if(oRes.bNetError)
 	{
-		uint64_t* targets = (uint64_t*)oResult.bResult;
-		log_result_ok(jpsock::t64_to_diff(targets[3]));
+		log_result_error("[NETWORK ERROR]");
+		return;
+	}
+
+	iPoolCallTimes.push_back((uint16_t)oRes.iPingMs);
+	oPoolLatency.add(oRes.iPingMs / 1000.0);
+
+	if(oRes.bAccepted)
+	{
+		log_result_ok(oRes.iResultDiff);
 		printer::inst()->print_msg(L3, "Result accepted by the pool.");
 	}
 	else
 	{
-		if(!pool->have_sock_error())
-		{
-			printer::inst()->print_msg(L3, "Result rejected by the pool.");
+		printer::inst()->print_msg(L3, "Result rejected by the pool.");
 
-			std::string error = pool->get_call_error();
-
-			if(strncasecmp(error.c_str(), "Unauthenticated", 15) == 0)
-			{
-				printer::inst()->print_msg(L2, "Your miner was unable to find a share in time. Either the pool difficulty is too high, or the pool timeout is too low.");
-				pool->disconnect();
-			}
-
-			log_result_error(std::move(error));
+		if(strncasecmp(oRes.sError, "Unauthenticated", 15) == 0)
+		{
+			printer::inst()->print_msg(L2, "Your miner was unable to find a share in time. Either the pool difficulty is too high, or the pool timeout is too low.");
+			pick_pool_by_id(pool_id)->disconnect();
 		}
-		else
-			log_result_error("[NETWORK ERROR]");
+
+		log_result_error(std::string(oRes.sError));
 	}
 }
 
@@ -383,6 +399,10 @@ void executor::ex_main()
 	// be here even if our first result is a failure
 	vMineResults.emplace_back();
 
+	// Have the web pages ready before the first tick
+	if(jconf::inst()->GetHttpdPort() != 0)
+		refresh_http_reports();
+
 	// If the user requested it, start the autohash printer
 	if(jconf::inst()->GetVerboseLevel() >= 4)
 		push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
@@ -409,6 +429,10 @@ void executor::ex_main()
 			on_miner_result(ev.iPoolId, ev.oJobResult);
 			break;
 
+		case EV_POOL_SUBMIT_RESULT:
+			on_submit_result(ev.iPoolId, ev.oSubmitResult);
+			break;
+
 		case EV_RECONNECT:
 			on_reconnect(ev.iPoolId);
 			break;
@@ -422,6 +446,11 @@ void executor::ex_main()
 			break;
 
 		case EV_PERF_TICK:
+			if(usr_pool->is_running())
+				usr_pool->check_call_timeout();
+			if(dev_pool->is_running())
+				dev_pool->check_call_timeout();
+
 			for (i = 0; i < pvThreads->size(); i++)
 				telem->push_perf_value(i, pvThreads->at(i)->iHashCount.load(std::memory_order_relaxed),
 				pvThreads->at(i)->iTimestamp.load(std::memory_order_relaxed));
@@ -449,6 +478,9 @@ void executor::ex_main()
 				if(normal && fHighestHps < fHps)
 					fHighestHps = fHps;
 			}
+
+			if((cnt & 0x1) == 0 && jconf::inst()->GetHttpdPort() != 0) //Every second
+				refresh_http_reports();
 		break;
 
 		case EV_USR_HASHRATE:
@@ -457,13 +489,6 @@ void executor::ex_main()
 			print_report(ev.iName);
 			break;
 
-		case EV_HTML_HASHRATE:
-		case EV_HTML_RESULTS:
-		case EV_HTML_CONNSTAT:
-		case EV_HTML_JSON:
-			http_report(ev.iName);
-			break;
-
 		case EV_HASHRATE_LOOP:
 			print_report(EV_USR_HASHRATE);
 			push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
@@ -488,6 +513,129 @@ inline const char* hps_format(double h, char* buf, size_t l)
 		return " (na)";
 }
 
+inline const char* metric_format(double v, char* buf, size_t l)
+{
+	if(std::isnormal(v) || v == 0.0)
+		snprintf(buf, l, "%.2f", v);
+	else
+		snprintf(buf, l, "NaN");
+	return buf;
+}
+
+static void metric_histogram(std::string& out, const char* sName, const char* sHelp, const double* fBounds,
+	const uint64_t* iBuckets, size_t iBucketCnt, double fSum, uint64_t iCount)
+{
+	char buf[256];
+	uint64_t iCumulative = 0;
+
+	snprintf(buf, sizeof(buf), "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", sName, sName, sName, sHelp);
+	out.append(buf);
+
+	for(size_t i = 0; i < iBucketCnt; i++)
+	{
+		iCumulative += iBuckets[i];
+		if(i < iBucketCnt - 1)
+			snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", sName, fBounds[i], int_port(iCumulative));
+		else
+			snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n", sName, int_port(iCumulative));
+		out.append(buf);
+	}
+
+	snprintf(buf, sizeof(buf), "%s_sum %.6f\n%s_count %llu\n", sName, fSum, sName, int_port(iCount));
+	out.append(buf);
+}
+
+void executor::metrics_report(std::string& out)
+{
+	static const size_t iWindows[3] = { 2500, 60000, 900000 };
+	static const char* sWindows[3] = { "2.5s", "60s", "15m" };
+
+	char buf[256], num[32];
+	size_t nthd = pvThreads->size();
+	out.reserve(1024 + nthd * 512);
+
+	out.append("# TYPE xmrstak_hashrate gauge\n# HELP xmrstak_hashrate Hashes per second over a trailing window.\n");
+	for(size_t i = 0; i < nthd; i++)
+	{
+		for(size_t w = 0; w < 3; w++)
+		{
+			snprintf(buf, sizeof(buf), "xmrstak_hashrate{thread=\"%llu\",window=\"%s\"} %s\n", int_port(i), sWindows[w],
+				metric_format(telem->calc_telemetry_data(iWindows[w], i), num, sizeof(num)));
+			out.append(buf);
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "# TYPE xmrstak_hashrate_highest gauge\n"
+		"# HELP xmrstak_hashrate_highest Highest total hashrate seen since the start.\nxmrstak_hashrate_highest %s\n",
+		metric_format(fHighestHps, num, sizeof(num)));
+	out.append(buf);
+
+	out.append("# TYPE xmrstak_hashes counter\n# HELP xmrstak_hashes Hashes computed by the thread.\n");
+	for(size_t i = 0; i < nthd; i++)
+	{
+		snprintf(buf, sizeof(buf), "xmrstak_hashes_total{thread=\"%llu\"} %llu\n", int_port(i),
+			int_port(pvThreads->at(i)->iHashCount.load(std::memory_order_relaxed)));
+		out.append(buf);
+	}
+
+	out.append("# TYPE xmrstak_starved_seconds counter\n# UNIT xmrstak_starved_seconds seconds\n"
+		"# HELP xmrstak_starved_seconds Time the thread spent waiting for a job.\n");
+	for(size_t i = 0; i < nthd; i++)
+	{
+		snprintf(buf, sizeof(buf), "xmrstak_starved_seconds_total{thread=\"%llu\"} %.3f\n", int_port(i),
+			pvThreads->at(i)->iStarvedMs.load(std::memory_order_relaxed) / 1000.0);
+		out.append(buf);
+	}
+
+	// Every scratchpad is in exactly one of the memory types, so they can be summed up
+	out.append("# TYPE xmrstak_scratchpads gauge\n# HELP xmrstak_scratchpads Scratchpads of the thread by memory type.\n");
+	for(size_t i = 0; i < nthd; i++)
+	{
+		minethd* thd = pvThreads->at(i);
+		uint32_t iLarge = thd->iCtxLargePage.load(std::memory_order_relaxed);
+		uint32_t iLocked = thd->iCtxLocked.load(std::memory_order_relaxed);
+		uint32_t iCnt = thd->iCtxCnt.load(std::memory_order_relaxed);
+		snprintf(buf, sizeof(buf), "xmrstak_scratchpads{thread=\"%llu\",memory=\"large_page_locked\"} %u\n"
+			"xmrstak_scratchpads{thread=\"%llu\",memory=\"large_page_unlocked\"} %u\n"
+			"xmrstak_scratchpads{thread=\"%llu\",memory=\"normal\"} %u\n",
+			int_port(i), iLocked, int_port(i), iLarge - iLocked, int_port(i), iCnt - iLarge);
+		out.append(buf);
+	}
+
+	uint64_t iRejected = 0;
+	for(size_t i = 1; i < vMineResults.size(); i++)
+		iRejected += vMineResults[i].count;
+
+	snprintf(buf, sizeof(buf), "# TYPE xmrstak_shares counter\n# HELP xmrstak_shares Shares sent to the pool by outcome.\n"
+		"xmrstak_shares_total{result=\"accepted\"} %llu\nxmrstak_shares_total{result=\"rejected\"} %llu\n",
+		int_port(vMineResults[0].count), int_port(iRejected));
+	out.append(buf);
+
+	snprintf(buf, sizeof(buf), "# TYPE xmrstak_pool_difficulty gauge\n"
+		"# HELP xmrstak_pool_difficulty Difficulty of the current pool job.\nxmrstak_pool_difficulty %llu\n", int_port(iPoolDiff));
+	out.append(buf);
+
+	metric_histogram(out, "xmrstak_pool_latency_seconds", "Round trip time of share submits.", oPoolLatency.fBounds,
+		oPoolLatency.iBuckets, latency_hist::iBucketCnt, oPoolLatency.fSum, oPoolLatency.iCount);
+	metric_histogram(out, "xmrstak_job_switch_seconds", "Time from receiving a job to handing it to the threads.",
+		oJobSwitchLatency.fBounds, oJobSwitchLatency.iBuckets, latency_hist::iBucketCnt, oJobSwitchLatency.fSum,
+		oJobSwitchLatency.iCount);
+
+	out.append("# EOF\n");
+}
+
+// Average time a mining thread spent waiting for a job, it goes up after disconnects and pool switches
+double executor::starved_seconds()
+{
+	size_t nthd = pvThreads->size();
+	uint64_t iTotalMs = 0;
+
+	for (size_t i = 0; i < nthd; i++)
+		iTotalMs += pvThreads->at(i)->iStarvedMs.load(std::memory_order_relaxed);
+
+	return nthd != 0 ? double(iTotalMs) / (nthd * 1000.0) : 0.0;
+}
+
 void executor::hashrate_report(std::string& out)
 {
 	char num[32];
@@ -542,6 +690,50 @@ void executor::hashrate_report(std::string& out)
 	out.append(" H/s\nHighest: ");
 	out.append(hps_format(fHighestHps, num, sizeof(num)));
 	out.append(" H/s\n");
+
+	snprintf(num, sizeof(num), "Starved: %.1f s\n", starved_seconds());
+	out.append(num);
+
+	double fP50, fP99, fJitter;
+	telem->calc_latency(nthd, fP50, fP99, fJitter);
+	out.append("Hash time (p50 / p99 / jitter):");
+	out.append(hps_format(fP50, num, sizeof(num))).append(" /");
+	out.append(hps_format(fP99, num, sizeof(num))).append(" /");
+	out.append(hps_format(fJitter, num, sizeof(num))).append(" ms\n");
+
+	// Threads per page size, the ones that didn't get real large pages are listed by ID
+	out.append("Scratchpad pages:");
+	bool bFirst = true;
+	for(int iPages = CTX_PAGES_1GB; iPages >= CTX_PAGES_NORMAL; iPages--)
+	{
+		std::string sIds;
+		size_t iCnt = 0;
+		for (i = 0; i < nthd; i++)
+		{
+			if(pvThreads->at(i)->iCtxPages.load(std::memory_order_relaxed) != iPages)
+				continue;
+
+			iCnt++;
+			if(iPages < CTX_PAGES_2MB)
+			{
+				snprintf(num, sizeof(num), "%s%u", sIds.empty() ? "" : ",", (unsigned int)i);
+				sIds.append(num);
+			}
+		}
+
+		if(iCnt == 0)
+			continue;
+
+		snprintf(num, sizeof(num), "%s %s x%u", bFirst ? "" : ",", cryptonight_page_name(iPages), (unsigned int)iCnt);
+		out.append(num);
+		if(!sIds.empty())
+			out.append(" (ID ").append(sIds).append(")");
+		bFirst = false;
+	}
+	out.append(bFirst ? " (na)\n" : "\n");
+
+	snprintf(num, sizeof(num), "Nonces left in job: %.3f%%\n", nonce_alloc::inst()->space_left() * 100.0);
+	out.append(num);
 }
 
 char* time_format(char* buf, size_t len, std::chrono::system_clock::time_point time)
@@ -628,6 +820,17 @@ void executor::result_report(std::string& out)
 		out.append("Yay! No errors.\n");
 }
 
+// Event queue depth and how long a push took, including waking up the executor
+const char* executor::queue_format(char* buf, size_t l)
+{
+	thdq_stats st = oEventQ.get_stats();
+	uint64_t iAvgNs = st.pushes != 0 ? st.push_ns_total / st.pushes : 0;
+
+	snprintf(buf, l, "%llu (max %llu), push %llu ns avg / %llu ns max", int_port(st.depth), int_port(st.depth_max),
+		int_port(iAvgNs), int_port(st.push_ns_max));
+	return buf;
+}
+
 void executor::connection_report(std::string& out)
 {
 	char num[128];
@@ -654,6 +857,9 @@ void executor::connection_report(std::string& out)
 	else
 		out.append("Pool ping time  : (n/a)\n");
 
+	out.append("Pending submits : ").append(std::to_string(pool->get_pending_calls())).append(1, '\n');
+	out.append("Event queue     : ").append(queue_format(num, sizeof(num))).append(1, '\n');
+
 	out.append("\nNetwork error log:\n");
 	size_t ln = vSocketLog.size();
 	if(ln > 0)
@@ -736,7 +942,12 @@ void executor::http_hashrate_report(std::string& out)
 	hps_format(fTotal[2], num_c, sizeof(num_c));
 	hps_format(fHighestHps, num_d, sizeof(num_d));
 
-	snprintf(buffer, sizeof(buffer), sHtmlHashrateBodyLow, num_a, num_b, num_c, num_d);
+	double fP50, fP99, fJitter;
+	char num_e[32], num_f[32], num_g[32];
+	telem->calc_latency(nthd, fP50, fP99, fJitter);
+
+	snprintf(buffer, sizeof(buffer), sHtmlHashrateBodyLow, num_a, num_b, num_c, num_d, starved_seconds(),
+		hps_format(fP50, num_e, sizeof(num_e)), hps_format(fP99, num_f, sizeof(num_f)), hps_format(fJitter, num_g, sizeof(num_g)));
 	out.append(buffer);
 }
 
@@ -810,9 +1021,10 @@ void executor::http_connection_report(std::string& out)
 		ping_time = iPoolCallTimes[n_calls/2];
 	}
 
+	char queue[128];
 	snprintf(buffer, sizeof(buffer), sHtmlConnectionBodyHigh,
 		jconf::inst()->GetPoolAddress(),
-		cdate, ping_time);
+		cdate, ping_time, queue_format(queue, sizeof(queue)));
 	out.append(buffer);
 
 
@@ -841,12 +1053,15 @@ void executor::http_json_report(std::string& out)
 {
 	const char *a, *b, *c;
 	char num_a[32], num_b[32], num_c[32];
-	char hr_buffer[64];
-	std::string hr_thds, res_error, cn_error;
+	char hr_buffer[64], lat_buffer[64];
+	std::string hr_thds, hr_lat, hr_pages, res_error, cn_error;
+	double fP50, fP99, fJitter;
 
 	size_t nthd = pvThreads->size();
 	double fTotal[3] = { 0.0, 0.0, 0.0};
 	hr_thds.reserve(nthd * 32);
+	hr_lat.reserve(nthd * 32);
+	hr_pages.reserve(nthd * 8);
 
 	for(size_t i=0; i < nthd; i++)
 	{
@@ -866,6 +1081,21 @@ void executor::http_json_report(std::string& out)
 		c = hps_format_json(fHps[2], num_c, sizeof(num_c));
 		snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, a, b, c);
 		hr_thds.append(hr_buffer);
+
+		if(i != 0) hr_lat.append(1, ',');
+		telem->calc_latency(i, fP50, fP99, fJitter);
+		a = hps_format_json(fP50, num_a, sizeof(num_a));
+		b = hps_format_json(fP99, num_b, sizeof(num_b));
+		c = hps_format_json(fJitter, num_c, sizeof(num_c));
+		snprintf(lat_buffer, sizeof(lat_buffer), sJsonApiThdHashrate, a, b, c);
+		hr_lat.append(lat_buffer);
+
+		if(i != 0) hr_pages.append(1, ',');
+		uint8_t iPages = pvThreads->at(i)->iCtxPages.load(std::memory_order_relaxed);
+		if(iPages == minethd::iNoCtxPages)
+			hr_pages.append("null");
+		else
+			hr_pages.append(1, '"').append(cryptonight_page_name(iPages)).append(1, '"');
 	}
 
 	a = hps_format_json(fTotal[0], num_a, sizeof(num_a));
@@ -873,7 +1103,14 @@ void executor::http_json_report(std::string& out)
 	c = hps_format_json(fTotal[2], num_c, sizeof(num_c));
 	snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, a, b, c);
 
-	a = hps_format_json(fHighestHps, num_a, sizeof(num_a));
+	telem->calc_latency(nthd, fP50, fP99, fJitter);
+	a = hps_format_json(fP50, num_a, sizeof(num_a));
+	b = hps_format_json(fP99, num_b, sizeof(num_b));
+	c = hps_format_json(fJitter, num_c, sizeof(num_c));
+	snprintf(lat_buffer, sizeof(lat_buffer), sJsonApiThdHashrate, a, b, c);
+
+	char num_h[32];
+	const char* h = hps_format_json(fHighestHps, num_h, sizeof(num_h));
 
 	size_t iGoodRes = vMineResults[0].count, iTotalRes = iGoodRes;
 	size_t ln = vMineResults.size();
@@ -928,63 +1165,67 @@ void executor::http_json_report(std::string& out)
 		cn_error.append(buffer);
 	}
 
-	size_t bb_size = 1024 + hr_thds.size() + res_error.size() + cn_error.size();
+	thdq_stats qst = oEventQ.get_stats();
+	uint64_t iQueueAvgNs = qst.pushes != 0 ? qst.push_ns_total / qst.pushes : 0;
+
+	size_t bb_size = 1024 + hr_thds.size() + hr_lat.size() + hr_pages.size() + res_error.size() + cn_error.size();
 	std::unique_ptr<char[]> bigbuf( new char[ bb_size ] );
 
 	int bb_len = snprintf(bigbuf.get(), bb_size, sJsonApiFormat,
-		hr_thds.c_str(), hr_buffer, a,
+		hr_thds.c_str(), hr_buffer, h, starved_seconds(), hr_lat.c_str(), lat_buffer, hr_pages.c_str(), nonce_alloc::inst()->space_left(),
 		int_port(iPoolDiff), int_port(iGoodRes), int_port(iTotalRes), fAvgResTime, int_port(iPoolHashes),
 		int_port(iTopDiff[0]), int_port(iTopDiff[1]), int_port(iTopDiff[2]), int_port(iTopDiff[3]), int_port(iTopDiff[4]),
 		int_port(iTopDiff[5]), int_port(iTopDiff[6]), int_port(iTopDiff[7]), int_port(iTopDiff[8]), int_port(iTopDiff[9]),
-		res_error.c_str(), jconf::inst()->GetPoolAddress(), int_port(iConnSec), int_port(iPoolPing), cn_error.c_str());
+		res_error.c_str(), jconf::inst()->GetPoolAddress(), int_port(iConnSec), int_port(iPoolPing), cn_error.c_str(),
+		int_port(qst.depth), int_port(qst.depth_max), int_port(qst.pushes), int_port(iQueueAvgNs), int_port(qst.push_ns_max));
 
 	out = std::string(bigbuf.get(), bigbuf.get() + bb_len);
 }
 
-void executor::http_report(ex_event_name ev)
+void executor::refresh_http_reports()
 {
-	assert(pHttpString != nullptr);
-
-	switch(ev)
+	for(size_t i=0; i < iHttpReportCnt; i++)
 	{
-	case EV_HTML_HASHRATE:
-		http_hashrate_report(*pHttpString);
-		break;
-
-	case EV_HTML_RESULTS:
-		http_result_report(*pHttpString);
-		break;
+		std::shared_ptr<http_report> rep = std::make_shared<http_report>();
 
-	case EV_HTML_CONNSTAT:
-		http_connection_report(*pHttpString);
-		break;
+		switch(EV_HTML_HASHRATE + i)
+		{
+		case EV_HTML_HASHRATE:
+			http_hashrate_report(rep->sBody);
+			break;
 
-	case EV_HTML_JSON:
-		http_json_report(*pHttpString);
-		break;
+		case EV_HTML_RESULTS:
+			http_result_report(rep->sBody);
+			break;
 
-	default:
-		assert(false);
-		break;
-	}
+		case EV_HTML_CONNSTAT:
+			http_connection_report(rep->sBody);
+			break;
 
-	httpReady.set_value();
-}
+		case EV_HTML_JSON:
+			http_json_report(rep->sBody);
+			break;
 
-void executor::get_http_report(ex_event_name ev_id, std::string& data)
-{
-	std::lock_guard<std::mutex> lck(httpMutex);
+		case EV_HTML_METRICS:
+			metrics_report(rep->sBody);
+			break;
 
-	assert(pHttpString == nullptr);
-	assert(ev_id == EV_HTML_HASHRATE || ev_id == EV_HTML_RESULTS
-		|| ev_id == EV_HTML_CONNSTAT || ev_id == EV_HTML_JSON);
+		default:
+			assert(false);
+			break;
+		}
 
-	pHttpString = &data;
-	httpReady = std::promise<void>();
-	std::future<void> ready = httpReady.get_future();
+		// FNV-1a of the body, clients that send it back get a 304 while nothing changed
+		uint64_t iHash = 0xcbf29ce484222325ull;
+		for(char c : rep->sBody)
+			iHash = (iHash ^ (uint8_t)c) * 0x100000001b3ull;
+		snprintf(rep->sEtag, sizeof(rep->sEtag), "\"%016llx\"", int_port(iHash));
 
-	push_event(ex_event(ev_id));
+		// Same page as last time - keep the old snapshot
+		std::shared_ptr<const http_report> old = std::atomic_load(&pHttpReports[i]);
+		if(old && strcmp(old->sEtag, rep->sEtag) == 0 && old->sBody == rep->sBody)
+			continue;
 
-	ready.wait();
-	pHttpString = nullptr;
+		std::atomic_store(&pHttpReports[i], std::shared_ptr<const http_report>(std::move(rep)));
+	}
 }
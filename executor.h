@@ -4,7 +4,10 @@
 #include <atomic>
 #include <array>
 #include <list>
-#include <future>
+#include <vector>
+#include <memory>
+#include <string.h>
+#include <assert.h>
 
 class jpsock;
 class minethd;
@@ -21,7 +24,19 @@ public:
 
 	void ex_start(bool daemon) { daemon ? ex_main() : std::thread(&executor::ex_main, this).detach(); }
 
-	void get_http_report(ex_event_name ev_id, std::string& data);
+	struct http_report
+	{
+		std::string sBody;
+		char sEtag[24];
+	};
+
+	// Last snapshot of a report (EV_HTML_*), the executor renders a new one every second.
+	// Never blocks on the executor, nullptr until the first one is out.
+	std::shared_ptr<const http_report> get_http_report(ex_event_name ev_id)
+	{
+		assert(ev_id >= EV_HTML_HASHRATE && ev_id <= EV_HTML_METRICS);
+		return std::atomic_load(&pHttpReports[ev_id - EV_HTML_HASHRATE]);
+	}
 
 	inline void push_event(ex_event&& ev) { oEventQ.push(std::move(ev)); }
 	void push_timed_event(ex_event&& ev, size_t sec);
@@ -70,7 +85,40 @@ private:
 	void ex_clock_thd();
 	void pool_connect(jpsock* pool);
 
+	// Cumulative histogram as OpenMetrics wants it, the last bucket is +Inf
+	struct latency_hist
+	{
+		constexpr static size_t iBucketCnt = 10;
+		double fBounds[iBucketCnt - 1];
+		uint64_t iBuckets[iBucketCnt];
+		double fSum;
+		uint64_t iCount;
+
+		latency_hist(const double (&bounds)[iBucketCnt - 1]) : fSum(0.0), iCount(0)
+		{
+			memcpy(fBounds, bounds, sizeof(fBounds));
+			memset(iBuckets, 0, sizeof(iBuckets));
+		}
+
+		void add(double fSec)
+		{
+			size_t i = 0;
+			while(i < iBucketCnt - 1 && fSec > fBounds[i])
+				i++;
+			iBuckets[i]++;
+			fSum += fSec;
+			iCount++;
+		}
+	};
+
+	latency_hist oPoolLatency;
+	latency_hist oJobSwitchLatency;
+
+	void metrics_report(std::string& out);
+
 	void hashrate_report(std::string& out);
+	double starved_seconds();
+	const char* queue_format(char* buf, size_t l);
 	void result_report(std::string& out);
 	void connection_report(std::string& out);
 
@@ -79,12 +127,11 @@ private:
 	void http_connection_report(std::string& out);
 	void http_json_report(std::string& out);
 
-	void http_report(ex_event_name ev);
 	void print_report(ex_event_name ev);
 
-	std::string* pHttpString = nullptr;
-	std::promise<void> httpReady;
-	std::mutex httpMutex;
+	constexpr static size_t iHttpReportCnt = EV_HTML_METRICS - EV_HTML_HASHRATE + 1;
+	std::shared_ptr<const http_report> pHttpReports[iHttpReportCnt];
+	void refresh_http_reports();
 
 	size_t iReconnectAttempts = 0;
 
@@ -166,6 +213,7 @@ private:
 	void on_sock_error(size_t pool_id, std::string&& sError);
 	void on_pool_have_job(size_t pool_id, pool_job& oPoolJob);
 	void on_miner_result(size_t pool_id, job_result& oResult);
+	void on_submit_result(size_t pool_id, submit_result& oRes);
 	void on_reconnect(size_t pool_id);
 	void on_switch_pool(size_t pool_id);
 
@@ -23,24 +23,34 @@
 
 #ifndef CONF_NO_HTTPD
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <mutex>
 
 #include "msgstruct.h"
 #include "httpd.h"
 #include "console.h"
 #include "executor.h"
+#include "minethd.h"
 #include "jconf.h"
 
 #include "webdesign.h"
 
 #include <microhttpd.h>
 #ifdef _WIN32
+#include <windows.h>
 #define strcasecmp _stricmp
+#else
+#include <pthread.h>
 #endif // _WIN32
 
+// Idle keep-alive connections are dropped after this many seconds
+constexpr unsigned int iConnTimeout = 30;
+
 httpd* httpd::oInst = nullptr;
 
 httpd::httpd()
@@ -48,6 +58,44 @@ httpd::httpd()
 
 }
 
+//Serves the executor's last snapshot of a report, we never wait for the executor here
+static int send_report(MHD_Connection* connection, ex_event_name ev_id, const char* sContentType)
+{
+	struct MHD_Response * rsp;
+	std::shared_ptr<const executor::http_report> rep = executor::inst()->get_http_report(ev_id);
+
+	if(!rep)
+	{ //Miner is still starting up
+		rsp = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+		MHD_add_response_header(rsp, "Retry-After", "1");
+
+		int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, rsp);
+		MHD_destroy_response(rsp);
+		return ret;
+	}
+
+	const char* req_etag = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+
+	if(req_etag != NULL && strcmp(req_etag, rep->sEtag) == 0)
+	{ //Cache hit
+		rsp = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+		MHD_add_response_header(rsp, "ETag", rep->sEtag);
+
+		int ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, rsp);
+		MHD_destroy_response(rsp);
+		return ret;
+	}
+
+	rsp = MHD_create_response_from_buffer(rep->sBody.size(), (void*)rep->sBody.c_str(), MHD_RESPMEM_MUST_COPY);
+	MHD_add_response_header(rsp, "ETag", rep->sEtag);
+	MHD_add_response_header(rsp, "Cache-Control", "no-cache");
+	MHD_add_response_header(rsp, "Content-Type", sContentType);
+
+	int ret = MHD_queue_response(connection, MHD_HTTP_OK, rsp);
+	MHD_destroy_response(rsp);
+	return ret;
+}
+
 int httpd::req_handler(void * cls,
 	        MHD_Connection* connection,
 	        const char* url,
@@ -64,7 +112,19 @@ int httpd::req_handler(void * cls,
 
 	*ptr = nullptr;
 
-	std::string str;
+	//All requests are handled on the daemon's single polling thread, pin it the first time we see it
+	static std::once_flag oPinned;
+	std::call_once(oPinned, []() {
+		int64_t aff = jconf::inst()->GetHttpdAffinity();
+		if(aff < 0)
+			return;
+#ifdef _WIN32
+		thd_setaffinity(GetCurrentThread(), aff);
+#else
+		thd_setaffinity(pthread_self(), aff);
+#endif
+	});
+
 	if(strcasecmp(url, "/style.css") == 0)
 	{
 		const char* req_etag = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
@@ -83,33 +143,15 @@ int httpd::req_handler(void * cls,
 		MHD_add_response_header(rsp, "Content-Type", "text/css; charset=utf-8");
 	}
 	else if(strcasecmp(url, "/api.json") == 0)
-	{
-		executor::inst()->get_http_report(EV_HTML_JSON, str);
-
-		rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-		MHD_add_response_header(rsp, "Content-Type", "application/json; charset=utf-8");
-	}
+		return send_report(connection, EV_HTML_JSON, "application/json; charset=utf-8");
+	else if(strcasecmp(url, "/metrics") == 0)
+		return send_report(connection, EV_HTML_METRICS, "application/openmetrics-text; version=1.0.0; charset=utf-8");
 	else if(strcasecmp(url, "/h") == 0 || strcasecmp(url, "/hashrate") == 0)
-	{
-		executor::inst()->get_http_report(EV_HTML_HASHRATE, str);
-
-		rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-		MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
-	}
+		return send_report(connection, EV_HTML_HASHRATE, "text/html; charset=utf-8");
 	else if(strcasecmp(url, "/c") == 0 || strcasecmp(url, "/connection") == 0)
-	{
-		executor::inst()->get_http_report(EV_HTML_CONNSTAT, str);
-
-		rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-		MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
-	}
+		return send_report(connection, EV_HTML_CONNSTAT, "text/html; charset=utf-8");
 	else if(strcasecmp(url, "/r") == 0 || strcasecmp(url, "/results") == 0)
-	{
-		executor::inst()->get_http_report(EV_HTML_RESULTS, str);
-
-		rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-		MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
-	}
+		return send_report(connection, EV_HTML_RESULTS, "text/html; charset=utf-8");
 	else
 	{
 		//Do a 302 redirect to /h
@@ -135,10 +177,32 @@ int httpd::req_handler(void * cls,
 
 bool httpd::start_daemon()
 {
-	d = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
+	// One polling thread serves every connection, so a burst of requests can't spawn threads
+	// that compete with the miners. Keep-alive is on by default for HTTP/1.1 clients.
+	unsigned int iFlags = MHD_USE_SELECT_INTERNALLY;
+#if defined(__linux__)
+	iFlags |= MHD_USE_EPOLL_LINUX_ONLY;
+#elif !defined(_WIN32)
+	iFlags |= MHD_USE_POLL;
+#endif
+
+	d = MHD_start_daemon(iFlags,
 		jconf::inst()->GetHttpdPort(), NULL, NULL,
-		&httpd::req_handler,
-		NULL, MHD_OPTION_END);
+		&httpd::req_handler, NULL,
+		MHD_OPTION_CONNECTION_LIMIT, (unsigned int)jconf::inst()->GetHttpdMaxConn(),
+		MHD_OPTION_CONNECTION_TIMEOUT, iConnTimeout,
+		MHD_OPTION_END);
+
+	if(d == nullptr && iFlags != MHD_USE_SELECT_INTERNALLY)
+	{
+		//libmicrohttpd might be built without epoll / poll, plain select will do
+		d = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY,
+			jconf::inst()->GetHttpdPort(), NULL, NULL,
+			&httpd::req_handler, NULL,
+			MHD_OPTION_CONNECTION_LIMIT, (unsigned int)jconf::inst()->GetHttpdMaxConn(),
+			MHD_OPTION_CONNECTION_TIMEOUT, iConnTimeout,
+			MHD_OPTION_END);
+	}
 
 	if(d == nullptr)
 	{
@@ -150,4 +214,3 @@ bool httpd::start_daemon()
 }
 
 #endif
-
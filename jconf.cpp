@@ -45,10 +45,11 @@ using namespace rapidjson;
 /*
  * This enum needs to match index in oConfigValues, otherwise we will get a runtime error
  */
-enum configEnum { aCpuThreadsConf, sUseSlowMem, bNiceHashMode, bAesOverride,
+enum configEnum { aCpuThreadsConf, sUseSlowMem, bUse1GbPages, bNiceHashMode, bAesOverride,
+	bMultiwayPipeline, iYieldEvery, sSchedPolicy, iNiceLevel,
 	bTlsMode, bTlsSecureAlgo, sTlsFingerprint, sPoolAddr, sWalletAddr, sPoolPwd,
 	iCallTimeout, iNetRetry, iGiveUpLimit, iVerboseLevel, iAutohashTime,
-	bDaemonMode, sOutputFile, iHttpdPort, bPreferIpv4 };
+	bDaemonMode, sOutputFile, iHttpdPort, iHttpdMaxConn, iHttpdAffinity, bPreferIpv4 };
 
 struct configVal {
 	configEnum iName;
@@ -61,8 +62,13 @@ struct configVal {
 configVal oConfigValues[] = {
 	{ aCpuThreadsConf, "cpu_threads_conf", kNullType },
 	{ sUseSlowMem, "use_slow_memory", kStringType },
+	{ bUse1GbPages, "use_1gb_pages", kTrueType },
 	{ bNiceHashMode, "nicehash_nonce", kTrueType },
 	{ bAesOverride, "aes_override", kNullType },
+	{ bMultiwayPipeline, "multiway_pipeline", kTrueType },
+	{ iYieldEvery, "yield_every", kNumberType },
+	{ sSchedPolicy, "sched_policy", kStringType },
+	{ iNiceLevel, "nice_level", kNumberType },
 	{ bTlsMode, "use_tls", kTrueType },
 	{ bTlsSecureAlgo, "tls_secure_algo", kTrueType },
 	{ sTlsFingerprint, "tls_fingerprint", kStringType },
@@ -77,6 +83,8 @@ configVal oConfigValues[] = {
 	{ bDaemonMode, "daemon_mode", kTrueType },
 	{ sOutputFile, "output_file", kStringType },
 	{ iHttpdPort, "httpd_port", kNumberType },
+	{ iHttpdMaxConn, "httpd_max_connections", kNumberType },
+	{ iHttpdAffinity, "httpd_affine_to_cpu", kNullType },
 	{ bPreferIpv4, "prefer_ipv4", kTrueType }
 };
 
@@ -181,6 +189,40 @@ jconf::slow_mem_cfg jconf::GetSlowMemSetting()
 		return unknown_value;
 }
 
+bool jconf::Use1GbPages()
+{
+	return prv->configValues[bUse1GbPages]->GetBool();
+}
+
+bool jconf::MultiwayPipeline()
+{
+	return prv->configValues[bMultiwayPipeline]->GetBool();
+}
+
+uint64_t jconf::GetYieldEvery()
+{
+	return prv->configValues[iYieldEvery]->GetUint64();
+}
+
+jconf::sched_cfg jconf::GetSchedPolicy()
+{
+	const char* opt = prv->configValues[sSchedPolicy]->GetString();
+
+	if(strcasecmp(opt, "normal") == 0)
+		return sched_normal;
+	else if(strcasecmp(opt, "batch") == 0)
+		return sched_batch;
+	else if(strcasecmp(opt, "idle") == 0)
+		return sched_idle;
+	else
+		return sched_unknown;
+}
+
+int jconf::GetNiceLevel()
+{
+	return prv->configValues[iNiceLevel]->GetInt();
+}
+
 bool jconf::GetTlsSetting()
 {
 	return prv->configValues[bTlsMode]->GetBool();
@@ -259,6 +301,17 @@ uint16_t jconf::GetHttpdPort()
 	return prv->configValues[iHttpdPort]->GetUint();
 }
 
+uint32_t jconf::GetHttpdMaxConn()
+{
+	return prv->configValues[iHttpdMaxConn]->GetUint();
+}
+
+int64_t jconf::GetHttpdAffinity()
+{
+	const Value* aff = prv->configValues[iHttpdAffinity];
+	return aff->IsNumber() ? aff->GetInt64() : -1;
+}
+
 bool jconf::NiceHashMode()
 {
 	return prv->configValues[bNiceHashMode]->GetBool();
@@ -285,21 +338,68 @@ void jconf::cpuid(uint32_t eax, int32_t ecx, int32_t val[4])
 #endif
 }
 
+static uint64_t xgetbv(uint32_t idx)
+{
+#ifdef _WIN32
+	return _xgetbv(idx);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(idx));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
 bool jconf::check_cpu_features()
 {
 	constexpr int AESNI_BIT = 1 << 25;
+	constexpr int SSSE3_BIT = 1 << 9;
+	constexpr int OSXSAVE_BIT = 1 << 27;
+	constexpr int AVX_BIT = 1 << 28;
 	constexpr int SSE2_BIT = 1 << 26;
+	constexpr int AVX2_BIT = 1 << 5;
+	constexpr int BMI2_BIT = 1 << 8;
+	constexpr int AVX512F_BIT = 1 << 16;
+	constexpr int VAES_BIT = 1 << 9;
 	int32_t cpu_info[4];
-	bool bHaveSse2;
+	bool bHaveSse2, bHaveAvx;
+	uint64_t xcr0 = 0;
 
 	cpuid(1, 0, cpu_info);
 
-	bHaveAes = (cpu_info[2] & AESNI_BIT) != 0;
+	// The AES-NI kernels use PSHUFB too, no CPU with AES-NI lacks SSSE3 but a VM might hide it
+	bHaveAes = (cpu_info[2] & AESNI_BIT) != 0 && (cpu_info[2] & SSSE3_BIT) != 0;
 	bHaveSse2 = (cpu_info[3] & SSE2_BIT) != 0;
 
+	// AVX also needs the OS to save the YMM registers (XCR0 bits 1 and 2)
+	if((cpu_info[2] & OSXSAVE_BIT) != 0)
+		xcr0 = xgetbv(0);
+	bHaveAvx = (cpu_info[2] & AVX_BIT) != 0 && (xcr0 & 0x6) == 0x6;
+
+	iCpuIsa = bHaveAes ? cn_isa_aes : cn_isa_soft;
+	cpuid(0, 0, cpu_info);
+	if(bHaveAes && bHaveAvx && cpu_info[0] >= 7)
+	{
+		cpuid(7, 0, cpu_info);
+		if((cpu_info[1] & AVX2_BIT) != 0 && (cpu_info[1] & BMI2_BIT) != 0)
+			iCpuIsa = cn_isa_avx2;
+		if(iCpuIsa == cn_isa_avx2 && (cpu_info[2] & VAES_BIT) != 0)
+			iCpuIsa = cn_isa_vaes;
+		// AVX-512 state is opmask and both halves of ZMM (XCR0 bits 5-7)
+		if(iCpuIsa == cn_isa_vaes && (cpu_info[1] & AVX512F_BIT) != 0 && (xcr0 & 0xE6) == 0xE6)
+			iCpuIsa = cn_isa_avx512;
+	}
+
 	return bHaveSse2;
 }
 
+cn_isa jconf::GetKernelIsa()
+{
+	// aes_override can force hardware AES on or off regardless of what we detected
+	if(!bHaveAes)
+		return cn_isa_soft;
+	return cn_compiled_isa(iCpuIsa > cn_isa_aes ? iCpuIsa : cn_isa_aes);
+}
+
 bool jconf::parse_config(const char* sFilename)
 {
 	FILE * pFile;
@@ -410,16 +510,31 @@ bool jconf::parse_config(const char* sFilename)
 		}
 	}
 
-	if(NiceHashMode() && GetThreadCount() >= 32)
+	if(GetSlowMemSetting() == unknown_value)
+	{
+		printer::inst()->print_msg(L0,
+			"Invalid config file. use_slow_memory must be \"always\", \"no_mlck\", \"warn\" or \"never\"");
+		return false;
+	}
+
+	if(!prv->configValues[iYieldEvery]->IsUint64())
 	{
-		printer::inst()->print_msg(L0, "You need to use less than 32 threads in NiceHash mode.");
+		printer::inst()->print_msg(L0,
+			"Invalid config file. yield_every needs to be a positive integer or 0.");
 		return false;
 	}
 
-	if(GetSlowMemSetting() == unknown_value)
+	if(GetSchedPolicy() == sched_unknown)
 	{
 		printer::inst()->print_msg(L0,
-			"Invalid config file. use_slow_memory must be \"always\", \"no_mlck\", \"warn\" or \"never\"");
+			"Invalid config file. sched_policy must be \"normal\", \"batch\" or \"idle\"");
+		return false;
+	}
+
+	if(!prv->configValues[iNiceLevel]->IsInt() || GetNiceLevel() < -20 || GetNiceLevel() > 19)
+	{
+		printer::inst()->print_msg(L0,
+			"Invalid config file. nice_level needs to be an integer between -20 and 19.");
 		return false;
 	}
 
@@ -446,6 +561,21 @@ bool jconf::parse_config(const char* sFilename)
 		return false;
 	}
 
+	if(!prv->configValues[iHttpdMaxConn]->IsUint() || GetHttpdMaxConn() == 0)
+	{
+		printer::inst()->print_msg(L0,
+			"Invalid config file. httpd_max_connections needs to be a positive integer.");
+		return false;
+	}
+
+	const Value* httpd_aff = prv->configValues[iHttpdAffinity];
+	if(!(httpd_aff->IsFalse() || (httpd_aff->IsInt64() && httpd_aff->GetInt64() >= 0)))
+	{
+		printer::inst()->print_msg(L0,
+			"Invalid config file. httpd_affine_to_cpu needs to be false or a CPU number.");
+		return false;
+	}
+
 #ifdef CONF_NO_TLS
 	if(prv->configValues[bTlsMode]->GetBool())
 	{
@@ -474,5 +604,7 @@ bool jconf::parse_config(const char* sFilename)
 	if(!bHaveAes)
 		printer::inst()->print_msg(L0, "Your CPU doesn't support hardware AES. Don't expect high hashrates.");
 
+	printer::inst()->print_msg(L0, "Using %s hash kernels.", cn_isa_name(GetKernelIsa()));
+
 	return true;
 }
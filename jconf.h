@@ -1,6 +1,7 @@
 #pragma once
 #include <stdlib.h>
 #include <string>
+#include "crypto/cryptonight_kernels.h"
 
 class jconf
 {
@@ -27,11 +28,24 @@ public:
 		unknown_value
 	};
 
+	enum sched_cfg {
+		sched_normal,
+		sched_batch,
+		sched_idle,
+		sched_unknown
+	};
+
 	size_t GetThreadCount();
 	bool GetThreadConfig(size_t id, thd_cfg &cfg);
 	bool NeedsAutoconf();
 
 	slow_mem_cfg GetSlowMemSetting();
+	bool Use1GbPages();
+	bool MultiwayPipeline();
+
+	uint64_t GetYieldEvery();
+	sched_cfg GetSchedPolicy();
+	int GetNiceLevel();
 
 	bool GetTlsSetting();
 	bool TlsSecureAlgos();
@@ -51,6 +65,8 @@ public:
 	uint64_t GetGiveUpLimit();
 
 	uint16_t GetHttpdPort();
+	uint32_t GetHttpdMaxConn();
+	int64_t GetHttpdAffinity();
 
 	bool NiceHashMode();
 
@@ -59,6 +75,7 @@ public:
 	bool PreferIpv4();
 
 	inline bool HaveHardwareAes() { return bHaveAes; }
+	cn_isa GetKernelIsa();
 
 	static void cpuid(uint32_t eax, int32_t ecx, int32_t val[4]);
 
@@ -71,4 +88,5 @@ private:
 	opaque_private* prv;
 
 	bool bHaveAes;
+	cn_isa iCpuIsa;
 };
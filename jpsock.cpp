@@ -27,6 +27,7 @@
 #include "jpsock.h"
 #include "executor.h"
 #include "jconf.h"
+#include "console.h"
 
 #include "rapidjson/document.h"
 #include "jext.h"
@@ -117,6 +118,10 @@ jpsock::jpsock(size_t id, bool tls) : pool_id(id)
 	bRunning = false;
 	bLoggedIn = false;
 	iJobDiff = 0;
+	iCallId = 0;
+
+	for(size_t i = 0; i < iMaxPendingCalls; i++)
+		oPendingCalls[i].iCallId = 0;
 
 	memset(&oCurrentJob, 0, sizeof(oCurrentJob));
 }
@@ -206,6 +211,8 @@ void jpsock::jpsock_thread()
 	if(bCallWaiting)
 		call_cond.notify_one();
 
+	fail_pending_calls();
+
 	bRunning = false;
 	bLoggedIn = false;
 
@@ -329,6 +336,22 @@ bool jpsock::process_line(char* line, size_t len)
 		}
 
 		std::unique_lock<std::mutex> mlock(call_mutex);
+		for(size_t i = 0; i < iMaxPendingCalls; i++)
+		{
+			pending_call& call = oPendingCalls[i];
+			if(call.iCallId == 0 || call.iCallId != iCallId)
+				continue;
+
+			using namespace std::chrono;
+			uint64_t iPing = duration_cast<milliseconds>(steady_clock::now() - call.tSent).count();
+			submit_result res(iCallId, call.iResultDiff, iPing > 0xFFFF ? 0xFFFF : (uint32_t)iPing, sError, iErrorLn);
+			call.iCallId = 0;
+			mlock.unlock();
+
+			executor::inst()->push_event(ex_event(res, pool_id));
+			return true;
+		}
+
 		if (prv->oCallRsp.pCallData == nullptr)
 		{
 			/*Server sent us a call reply without us making a call*/
@@ -409,6 +432,9 @@ bool jpsock::process_pool_job(const opq_json_val* params)
 
 	iJobDiff = t64_to_diff(oPoolJob.iTarget);
 
+	using namespace std::chrono;
+	oPoolJob.iRecvTime = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+
 	executor::inst()->push_event(ex_event(oPoolJob, pool_id));
 
 	std::unique_lock<std::mutex>(job_mutex);
@@ -416,8 +442,70 @@ bool jpsock::process_pool_job(const opq_json_val* params)
 	return true;
 }
 
+void jpsock::fail_pending_calls()
+{
+	uint64_t iFailed[iMaxPendingCalls];
+	size_t n = 0;
+
+	std::unique_lock<std::mutex> mlock(call_mutex);
+	for(size_t i = 0; i < iMaxPendingCalls; i++)
+	{
+		if(oPendingCalls[i].iCallId == 0)
+			continue;
+
+		iFailed[n++] = oPendingCalls[i].iCallId;
+		oPendingCalls[i].iCallId = 0;
+	}
+	mlock.unlock();
+
+	// push_event can wait for the executor when its queue is full, and the executor takes call_mutex
+	for(size_t i = 0; i < n; i++)
+	{
+		submit_result res;
+		res.iCallId = iFailed[i];
+		executor::inst()->push_event(ex_event(res, pool_id));
+	}
+}
+
+void jpsock::check_call_timeout()
+{
+	using namespace std::chrono;
+	steady_clock::time_point tLimit = steady_clock::now() - seconds(jconf::inst()->GetCallTimeout());
+	bool bTimeout = false;
+
+	std::unique_lock<std::mutex> mlock(call_mutex);
+	for(size_t i = 0; i < iMaxPendingCalls; i++)
+	{
+		if(oPendingCalls[i].iCallId != 0 && oPendingCalls[i].tSent < tLimit)
+			bTimeout = true;
+	}
+	mlock.unlock();
+
+	//The server is not taking to us, the recv thread will fail the outstanding submits on its way out
+	if(bTimeout)
+	{
+		set_socket_error("CALL error: Timeout while waiting for a reply");
+		disconnect();
+	}
+}
+
+size_t jpsock::get_pending_calls()
+{
+	size_t n = 0;
+	std::unique_lock<std::mutex> mlock(call_mutex);
+	for(size_t i = 0; i < iMaxPendingCalls; i++)
+	{
+		if(oPendingCalls[i].iCallId != 0)
+			n++;
+	}
+	return n;
+}
+
 bool jpsock::connect(const char* sAddr, std::string& sConnectError)
 {
+	// Anything left over from the last connection will never get an answer
+	fail_pending_calls();
+
 	bHaveSocketError = false;
 	sSocketError.clear();
 	iJobDiff = 0;
@@ -496,8 +584,8 @@ bool jpsock::cmd_login(const char* sLogin, const char* sPassword)
 {
 	char cmd_buffer[1024];
 
-	snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"login\",\"params\":{\"login\":\"%s\",\"pass\":\"%s\",\"agent\":\"" AGENTID_STR "\"},\"id\":1}\n",
-		sLogin, sPassword);
+	snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"login\",\"params\":{\"login\":\"%s\",\"pass\":\"%s\",\"agent\":\"" AGENTID_STR "\"},\"id\":%llu}\n",
+		sLogin, sPassword, int_port(++iCallId));
 
 	opq_json_val oResult(nullptr);
 
@@ -544,7 +632,7 @@ bool jpsock::cmd_login(const char* sLogin, const char* sPassword)
 	return true;
 }
 
-bool jpsock::cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult)
+bool jpsock::cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult, uint64_t iResultDiff)
 {
 	char cmd_buffer[1024];
 	char sNonce[9];
@@ -556,11 +644,35 @@ bool jpsock::cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bRes
 	bin2hex(bResult, 32, sResult);
 	sResult[64] = '\0';
 
-	snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"submit\",\"params\":{\"id\":\"%s\",\"job_id\":\"%s\",\"nonce\":\"%s\",\"result\":\"%s\"},\"id\":1}\n",
-		sMinerId, sJobId, sNonce, sResult);
+	/*Register the call before sending, the reply can beat us back from send otherwise*/
+	std::unique_lock<std::mutex> mlock(call_mutex);
+	pending_call* call = nullptr;
+	for(size_t i = 0; i < iMaxPendingCalls; i++)
+	{
+		if(oPendingCalls[i].iCallId == 0)
+		{
+			call = &oPendingCalls[i];
+			break;
+		}
+	}
 
-	opq_json_val oResult(nullptr);
-	return cmd_ret_wait(cmd_buffer, oResult);
+	if(call == nullptr)
+		return false;
+
+	uint64_t iThisCallId = ++iCallId;
+	call->iCallId = iThisCallId;
+	call->iResultDiff = iResultDiff;
+	call->tSent = std::chrono::steady_clock::now();
+	mlock.unlock();
+
+	snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"submit\",\"params\":{\"id\":\"%s\",\"job_id\":\"%s\",\"nonce\":\"%s\",\"result\":\"%s\"},\"id\":%llu}\n",
+		sMinerId, sJobId, sNonce, sResult, int_port(iThisCallId));
+
+	//On failure the recv thread fails every outstanding call, this one included
+	if(!sck->send(cmd_buffer))
+		disconnect();
+
+	return true;
 }
 
 bool jpsock::get_current_job(pool_job& job)
@@ -4,6 +4,7 @@
 #include <condition_variable>
 #include <thread>
 #include <string>
+#include <chrono>
 
 #include "msgstruct.h"
 
@@ -31,7 +32,12 @@ public:
 	void disconnect();
 
 	bool cmd_login(const char* sLogin, const char* sPassword);
-	bool cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult);
+	// Submits don't wait for the reply - the pool's answer arrives as an EV_POOL_SUBMIT_RESULT event.
+	// Returns false if the share couldn't be queued because too many submits are outstanding.
+	bool cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult, uint64_t iResultDiff);
+	// Drops the connection if the oldest outstanding submit is older than call_timeout
+	void check_call_timeout();
+	size_t get_pending_calls();
 
 	static bool hex2bin(const char* in, unsigned int len, unsigned char* out);
 	static void bin2hex(const unsigned char* in, unsigned int len, char* out);
@@ -78,6 +84,18 @@ private:
 	bool process_line(char* line, size_t len);
 	bool process_pool_job(const opq_json_val* params);
 	bool cmd_ret_wait(const char* sPacket, opq_json_val& poResult);
+	void fail_pending_calls();
+
+	struct pending_call
+	{
+		uint64_t iCallId; // 0 - free slot
+		uint64_t iResultDiff;
+		std::chrono::steady_clock::time_point tSent;
+	};
+
+	static constexpr size_t iMaxPendingCalls = 64;
+	pending_call oPendingCalls[iMaxPendingCalls];
+	uint64_t iCallId;
 
 	char sMinerId[64];
 	std::atomic<uint64_t> iJobDiff;
@@ -0,0 +1,348 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kernel_bench.h"
+#include "minethd.h"
+#include "jconf.h"
+#include "console.h"
+#include "version.h"
+#include "crypto/cryptonight_kernels.h"
+
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace
+{
+// Every variant is measured for at least a second and at least this many calls, after a
+// single warm-up call. A fixed count leaves the deviation meaningless on fast hosts.
+constexpr size_t iBenchMinSamples = 10;
+constexpr uint64_t iBenchMinNs = 1000000000;
+
+struct bench_stats
+{
+	double fMean;
+	double fStdDev;
+	double fMin;
+};
+
+bench_stats calc_stats(const std::vector<double>& v)
+{
+	bench_stats st = { 0.0, 0.0, v[0] };
+
+	for(double x : v)
+	{
+		st.fMean += x;
+		if(x < st.fMin)
+			st.fMin = x;
+	}
+	st.fMean /= v.size();
+
+	for(double x : v)
+		st.fStdDev += (x - st.fMean) * (x - st.fMean);
+	if(v.size() > 1)
+		st.fStdDev = std::sqrt(st.fStdDev / (v.size() - 1));
+
+	return st;
+}
+
+uint64_t get_ns()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// TSC and wall clock are both sampled around every timed call, so we can report the
+// effective TSC rate at the end and cycles stay comparable between hosts
+struct bench_clock
+{
+	uint64_t iTscTotal = 0;
+	uint64_t iNsTotal = 0;
+
+	template<typename F>
+	uint64_t measure(F f)
+	{
+		uint64_t iNs = get_ns();
+		uint64_t iTsc = __rdtsc();
+		f();
+		iTsc = __rdtsc() - iTsc;
+		iNsTotal += get_ns() - iNs;
+		iTscTotal += iTsc;
+		return iTsc;
+	}
+};
+
+void get_cpu_brand(char (&sBrand)[49])
+{
+	int32_t cpu_info[4];
+
+	memset(sBrand, 0, sizeof(sBrand));
+	jconf::cpuid(0x80000000, 0, cpu_info);
+	if((uint32_t)cpu_info[0] < 0x80000004)
+		return;
+
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		jconf::cpuid(0x80000002 + i, 0, cpu_info);
+		memcpy(sBrand + 16 * i, cpu_info, 16);
+	}
+
+	// Strip anything that would need escaping in JSON
+	for(char& c : sBrand)
+		if(c == '"' || c == '\\')
+			c = ' ';
+}
+
+const char sBenchKernel[] =
+	"{\"isa\":\"%s\",\"ways\":%llu,\"prefetch\":%s,\"pipelined\":%s,\"hashrate\":%.2f,\"ns_per_hash\":%.0f,"
+	"\"cycles_per_hash\":%.0f,\"cycles_stddev\":%.0f,\"cycles_min\":%.0f,\"samples\":%llu}";
+
+const char sBenchPhases[] =
+	"{\"isa\":\"%s\",\"prefetch\":%s";
+
+const char sBenchPhase[] =
+	",\"%s\":{\"cycles\":%.0f,\"cycles_stddev\":%.0f,\"cycles_min\":%.0f}";
+
+const char sBenchSched[] =
+	"{\"sched_policy\":\"%s\",\"yield_every\":%llu,\"applied\":%s,\"hashrate\":%.2f,\"yields\":%llu,"
+	"\"ns_per_yield\":%.0f,\"overhead_pct\":%.4f}";
+
+const char sBenchFormat[] =
+	"{\"version\":\"" XMR_STAK_NAME " " XMR_STAK_VERSION "\",\"cpu\":\"%s\",\"isa_selected\":\"%s\","
+	"\"hugepages\":%s,\"min_samples\":%llu,\"min_seconds\":%.1f,\"tsc_ghz\":%.3f,\"kernels\":[%s],\"phases\":[%s],\"sched\":[%s]}\n";
+
+// Hashes per scheduling variant, enough for a couple of hundred ms on a fast core
+constexpr size_t iSchedHashes = 128;
+
+struct sched_variant
+{
+	const char* sName;
+	jconf::sched_cfg policy;
+	uint64_t iYieldEvery;
+};
+
+const sched_variant oSchedVariants[] = {
+	{ "normal", jconf::sched_normal, 0 },
+	{ "normal", jconf::sched_normal, 16 },
+	{ "normal", jconf::sched_normal, 1 },
+	{ "batch", jconf::sched_batch, 0 },
+	{ "idle", jconf::sched_idle, 0 }
+};
+
+// Same loop shape as minethd::work_main. Runs on its own thread, so that policies we
+// can't undo without root (idle) don't stick to the main thread.
+void bench_sched(const sched_variant& v, cn_hash_fun hash_fun, cryptonight_ctx** ctx, std::string& out)
+{
+	bool bApplied = false;
+	uint64_t iYields = 0, iYieldNs = 0, iTotalNs = 0;
+
+	std::thread thd([&] {
+		uint8_t bWork[76] = {0};
+		uint8_t bOut[32];
+		uint64_t iSinceYield = 0;
+
+		bApplied = thd_setsched(v.policy, 0);
+
+		hash_fun(bWork, 76, bOut, ctx);
+
+		uint64_t iStart = get_ns();
+		for(size_t i = 0; i < iSchedHashes; i++)
+		{
+			bWork[39] = (uint8_t)i;
+			hash_fun(bWork, 76, bOut, ctx);
+
+			if(v.iYieldEvery != 0 && ++iSinceYield >= v.iYieldEvery)
+			{
+				iSinceYield = 0;
+				uint64_t iNs = get_ns();
+				std::this_thread::yield();
+				iYieldNs += get_ns() - iNs;
+				iYields++;
+			}
+		}
+		iTotalNs = get_ns() - iStart;
+	});
+	thd.join();
+
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), sBenchSched, v.sName, int_port(v.iYieldEvery), bApplied ? "true" : "false",
+		iSchedHashes * 1e9 / iTotalNs, int_port(iYields), iYields != 0 ? double(iYieldNs) / iYields : 0.0,
+		100.0 * iYieldNs / iTotalNs);
+
+	if(!out.empty())
+		out.append(1, ',');
+	out.append(buffer);
+}
+}
+
+bool bench_kernels(const char* sOutFile)
+{
+	const size_t MAX_N = CN_MAX_N;
+	cryptonight_ctx *ctx[MAX_N] = {0};
+	for(size_t i = 0; i < MAX_N; i++)
+	{
+		if((ctx[i] = minethd_alloc_ctx()) == nullptr)
+		{
+			for(size_t j = 0; j < i; j++)
+				minethd_free_ctx(ctx[j]);
+			return false;
+		}
+	}
+
+	FILE* fOut = stdout;
+	if(sOutFile != nullptr)
+	{
+		fOut = fopen(sOutFile, "wb");
+		if(fOut == nullptr)
+		{
+			printer::inst()->print_msg(L0, "Couldn't open %s for writing.", sOutFile);
+			for(size_t i = 0; i < MAX_N; i++)
+				minethd_free_ctx(ctx[i]);
+			return false;
+		}
+		printer::inst()->print_msg(L0, "Benchmarking hash kernels, this can take a while...");
+	}
+
+	uint8_t bWork[76 * MAX_N] = {0};
+	uint8_t bOut[32 * MAX_N];
+	bench_clock clk;
+	std::vector<double> vSamples;
+	std::string sKernels, sPhases;
+	char buffer[512];
+
+	cn_isa iTopIsa = jconf::inst()->GetKernelIsa();
+	for(int i = cn_isa_soft; i <= iTopIsa; i++)
+	{
+		cn_isa isa = (cn_isa)i;
+
+		// Levels the compiler couldn't build fall back to a lower one we already measured
+		if(cn_compiled_isa(isa) != isa)
+			continue;
+
+		for(size_t iPrefetch = 0; iPrefetch < 2; iPrefetch++)
+		{
+			bool bNoPrefetch = iPrefetch != 0;
+			const char* sPrefetch = bNoPrefetch ? "false" : "true";
+
+			// Lockstep kernels first, then the pipelined ones from 2 ways up. The call before the
+			// samples fills the pipeline, after that every call finishes n hashes.
+			for(size_t k = 0; k < 2 * MAX_N - 1; k++)
+			{
+				bool bPipeline = k >= MAX_N;
+				size_t n = bPipeline ? k - MAX_N + 2 : k + 1;
+				cn_hash_fun hash_fun = bPipeline ? cn_select_pipe_kernel(isa, n, bNoPrefetch) : cn_select_kernel(isa, n, bNoPrefetch);
+				uint64_t iNs = clk.iNsTotal;
+
+				hash_fun(bWork, 76, bOut, ctx);
+
+				vSamples.clear();
+				while(vSamples.size() < iBenchMinSamples || clk.iNsTotal - iNs < iBenchMinNs)
+				{
+					bWork[39] = (uint8_t)vSamples.size();
+					vSamples.push_back(double(clk.measure([&] { hash_fun(bWork, 76, bOut, ctx); })) / n);
+				}
+				double fNsPerHash = double(clk.iNsTotal - iNs) / (vSamples.size() * n);
+
+				bench_stats st = calc_stats(vSamples);
+				snprintf(buffer, sizeof(buffer), sBenchKernel, cn_isa_name(isa), int_port(n), sPrefetch,
+					bPipeline ? "true" : "false", 1e9 / fNsPerHash, fNsPerHash, st.fMean, st.fStdDev, st.fMin,
+					int_port(vSamples.size()));
+
+				if(!sKernels.empty())
+					sKernels.append(1, ',');
+				sKernels.append(buffer);
+			}
+
+			cn_phase_funs phases = cn_select_phases(isa, bNoPrefetch);
+			std::vector<double> vExplode, vMainLoop, vImplode, vKeccak, vKeccakf;
+			uint64_t iNs = clk.iNsTotal;
+			while(vExplode.size() < iBenchMinSamples || clk.iNsTotal - iNs < iBenchMinNs)
+			{
+				// hash_state still holds the last hash, that is as good as a fresh keccak for timing
+				vExplode.push_back((double)clk.measure([&] { phases.explode(ctx[0]); }));
+				vMainLoop.push_back((double)clk.measure([&] { phases.main_loop(ctx[0]); }));
+				vImplode.push_back((double)clk.measure([&] { phases.implode(ctx[0]); }));
+
+				// Both ends of a MAX_N way hash, per lane
+				vKeccak.push_back((double)clk.measure([&] { phases.keccak(bWork, 76, ctx, MAX_N); }) / MAX_N);
+				vKeccakf.push_back((double)clk.measure([&] { phases.keccakf(ctx, MAX_N); }) / MAX_N);
+			}
+
+			if(!sPhases.empty())
+				sPhases.append(1, ',');
+			snprintf(buffer, sizeof(buffer), sBenchPhases, cn_isa_name(isa), sPrefetch);
+			sPhases.append(buffer);
+
+			const char* sPhaseNames[] = { "explode", "main_loop", "implode", "keccak", "keccakf" };
+			const std::vector<double>* vPhases[] = { &vExplode, &vMainLoop, &vImplode, &vKeccak, &vKeccakf };
+			for(size_t i = 0; i < 5; i++)
+			{
+				bench_stats st = calc_stats(*vPhases[i]);
+				snprintf(buffer, sizeof(buffer), sBenchPhase, sPhaseNames[i], st.fMean, st.fStdDev, st.fMin);
+				sPhases.append(buffer);
+			}
+			sPhases.append(1, '}');
+		}
+	}
+
+	// Scheduling policies and yield frequencies, with the kernel the miner would pick for one hash
+	std::string sSched;
+	cn_hash_fun sched_fun = cn_select_kernel(iTopIsa, 1, false);
+	for(const sched_variant& v : oSchedVariants)
+		bench_sched(v, sched_fun, ctx, sSched);
+
+	char sBrand[49];
+	get_cpu_brand(sBrand);
+	double fTscGhz = clk.iNsTotal != 0 ? double(clk.iTscTotal) / clk.iNsTotal : 0.0;
+	bool bHugePages = ctx[0]->ctx_info[0] != 0;
+
+	size_t iLen = sKernels.size() + sPhases.size() + sSched.size() + 1024;
+	std::vector<char> vReport(iLen);
+	snprintf(vReport.data(), iLen, sBenchFormat, sBrand, cn_isa_name(iTopIsa), bHugePages ? "true" : "false",
+		int_port(iBenchMinSamples), iBenchMinNs / 1e9, fTscGhz, sKernels.c_str(), sPhases.c_str(), sSched.c_str());
+
+	fputs(vReport.data(), fOut);
+	if(fOut != stdout)
+	{
+		fclose(fOut);
+		printer::inst()->print_msg(L0, "Kernel benchmark written to %s.", sOutFile);
+	}
+	else
+		fflush(fOut);
+
+	for(size_t i = 0; i < MAX_N; i++)
+		minethd_free_ctx(ctx[i]);
+
+	return true;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Times every hash kernel variant the CPU can run (ISA level, N ways, prefetch) and the
+// explode, main loop and implode phases of the single hash on their own, followed by the cost
+// of the yield_every and sched_policy settings. The report is written as JSON to sOutFile,
+// or to stdout if sOutFile is nullptr.
+bool bench_kernels(const char* sOutFile);
@@ -26,8 +26,12 @@
 #include <chrono>
 #include <cstring>
 #include <thread>
-#include <bitset>
+#include <vector>
 #include "console.h"
+#include "jconf.h"
+#include "ctx_arena.h"
+#include "nonce_alloc.h"
+#include "topology.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -36,6 +40,16 @@ void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id)
 {
 	SetThreadAffinityMask(h, 1ULL << cpu_id);
 }
+
+bool thd_setsched(jconf::sched_cfg policy, int nice)
+{
+	// Windows has no batch class, below normal priority is the closest thing
+	if(policy == jconf::sched_batch)
+		return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL) != 0;
+	else if(policy == jconf::sched_idle)
+		return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE) != 0;
+	return true;
+}
 #else
 #include <pthread.h>
 
@@ -45,6 +59,11 @@ void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id)
 #define SYSCTL_CORE_COUNT   "machdep.cpu.core_count"
 #elif defined(__FreeBSD__)
 #include <pthread_np.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 
 
@@ -67,144 +86,247 @@ void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id)
 	pthread_setaffinity_np(h, sizeof(cpu_set_t), &mn);
 #endif
 }
+
+bool thd_setsched(jconf::sched_cfg policy, int nice)
+{
+#if defined(__linux__)
+	sched_param param;
+	param.sched_priority = 0;
+
+	if(policy == jconf::sched_batch && pthread_setschedparam(pthread_self(), SCHED_BATCH, &param) != 0)
+		return false;
+	if(policy == jconf::sched_idle && pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+		return false;
+
+	// On Linux nice is per thread, it has no effect on SCHED_IDLE
+	if(nice != 0 && setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) != 0)
+		return false;
+	return true;
+#else
+	return policy == jconf::sched_normal && nice == 0;
+#endif
+}
 #endif // _WIN32
 
 #include "executor.h"
 #include "minethd.h"
 #include "jconf.h"
-#include "crypto/cryptonight_aesni.h"
 #include "hwlocMemory.hpp"
 
 telemetry::telemetry(size_t iThd)
 {
-	ppHashCounts = new uint64_t*[iThd];
-	ppTimestamps = new uint64_t*[iThd];
-	iBucketTop = new uint32_t[iThd];
-
-	for (size_t i = 0; i < iThd; i++)
-	{
-		ppHashCounts[i] = new uint64_t[iBucketSize];
-		ppTimestamps[i] = new uint64_t[iBucketSize];
-		iBucketTop[i] = 0;
-		memset(ppHashCounts[0], 0, sizeof(uint64_t) * iBucketSize);
-		memset(ppTimestamps[0], 0, sizeof(uint64_t) * iBucketSize);
-	}
+	iThdCnt = iThd;
+	pThd = new thd_telemetry[iThd];
+	memset(pThd, 0, sizeof(thd_telemetry) * iThd);
 }
 
 double telemetry::calc_telemetry_data(size_t iLastMilisec, size_t iThread)
 {
 	using namespace std::chrono;
 	uint64_t iTimeNow = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
+	const thd_telemetry& t = pThd[iThread];
 
-	uint64_t iEarliestHashCnt = 0;
-	uint64_t iEarliestStamp = 0;
-	uint64_t iLastestStamp = 0;
-	uint64_t iLastestHashCnt = 0;
-	bool bHaveFullSet = false;
-
-	//Start at 1, buckettop points to next empty
-	for (size_t i = 1; i < iBucketSize; i++)
-	{
-		size_t idx = (iBucketTop[iThread] - i) & iBucketMask; //overflow expected here
+	//We need data from before the start of the window
+	if (t.iFirstStamp == 0 || iTimeNow < iLastMilisec || iTimeNow - iLastMilisec < t.iFirstStamp)
+		return nan("");
 
-		if (ppTimestamps[iThread][idx] == 0)
-			break; //That means we don't have the data yet
+	//Finest level that still spans the whole window
+	size_t iLevel = 0;
+	while (iLevel < iLevelCnt - 1 && iLastMilisec > level_ms(iLevel) * (iRollupSize - 2))
+		iLevel++;
 
-		if (iLastestStamp == 0)
-		{
-			iLastestStamp = ppTimestamps[iThread][idx];
-			iLastestHashCnt = ppHashCounts[iThread][idx];
-		}
+	uint64_t iStart = iTimeNow - iLastMilisec;
+	uint64_t iBucket = iStart / level_ms(iLevel);
+	uint64_t iLastBucket = t.oLatest.iTimestamp / level_ms(iLevel);
 
-		if (iTimeNow - ppTimestamps[iThread][idx] > iLastMilisec)
+	//Earliest sample inside the window, buckets without a sample are skipped
+	const perf_sample* pEarliest = nullptr;
+	for (; iBucket <= iLastBucket && iBucket < iStart / level_ms(iLevel) + iRollupSize; iBucket++)
+	{
+		const perf_sample& smp = t.oRollup[iLevel][iBucket & iRollupMask];
+		if (smp.iTimestamp != 0 && smp.iBucket == iBucket && smp.iTimestamp >= iStart)
 		{
-			bHaveFullSet = true;
-			break; //We are out of the requested time period
+			pEarliest = &smp;
+			break;
 		}
-
-		iEarliestStamp = ppTimestamps[iThread][idx];
-		iEarliestHashCnt = ppHashCounts[iThread][idx];
 	}
 
-	if (!bHaveFullSet || iEarliestStamp == 0 || iLastestStamp == 0)
+	if (pEarliest == nullptr)
 		return nan("");
 
 	//Don't think that can happen, but just in case
-	if (iLastestStamp - iEarliestStamp == 0)
+	if (t.oLatest.iTimestamp <= pEarliest->iTimestamp)
 		return nan("");
 
 	double fHashes, fTime;
-	fHashes = iLastestHashCnt - iEarliestHashCnt;
-	fTime = iLastestStamp - iEarliestStamp;
+	fHashes = t.oLatest.iHashCount - pEarliest->iHashCount;
+	fTime = t.oLatest.iTimestamp - pEarliest->iTimestamp;
 	fTime /= 1000.0;
 
 	return fHashes / fTime;
 }
 
+size_t telemetry::latency_bucket(float fLat)
+{
+	if (!(fLat > 0.0f))
+		return 0;
+
+	int iBucket = (int)std::floor(std::log2(fLat) * 16.0f) + iLatencyZeroBucket;
+	if (iBucket < 0)
+		return 0;
+	return iBucket < (int)iLatencyBuckets ? iBucket : iLatencyBuckets - 1;
+}
+
+void telemetry::calc_latency(size_t iThread, double& fP50, double& fP99, double& fJitter)
+{
+	size_t iFirst = iThread, iLast = iThread + 1;
+	if (iThread == iThdCnt)
+	{
+		iFirst = 0;
+		iLast = iThdCnt;
+	}
+
+	size_t iCnt = 0;
+	fJitter = 0.0;
+	for (size_t i = iFirst; i < iLast; i++)
+	{
+		iCnt += pThd[i].iLatencyCnt;
+		fJitter += pThd[i].fJitter;
+	}
+
+	if (iCnt == 0)
+	{
+		fP50 = fP99 = fJitter = nan("");
+		return;
+	}
+
+	fJitter /= (iLast - iFirst);
+
+	//Walk the histograms until we pass the rank of each percentile, the value is the middle of that bucket
+	size_t iP50 = iCnt / 2;
+	size_t iP99 = (iCnt * 99) / 100;
+	size_t iSeen = 0;
+	bool bHaveP50 = false;
+	for (size_t b = 0; b < iLatencyBuckets; b++)
+	{
+		for (size_t i = iFirst; i < iLast; i++)
+			iSeen += pThd[i].iLatencyHist[b];
+
+		double fValue = std::exp2((double(b) - iLatencyZeroBucket + 0.5) / 16.0);
+		if (!bHaveP50 && iSeen > iP50)
+		{
+			fP50 = fValue;
+			bHaveP50 = true;
+		}
+		if (iSeen > iP99)
+		{
+			fP99 = fValue;
+			return;
+		}
+	}
+}
+
 void telemetry::push_perf_value(size_t iThd, uint64_t iHashCount, uint64_t iTimestamp)
 {
-	size_t iTop = iBucketTop[iThd];
-	ppHashCounts[iThd][iTop] = iHashCount;
-	ppTimestamps[iThd][iTop] = iTimestamp;
+	thd_telemetry& t = pThd[iThd];
 
-	iBucketTop[iThd] = (iTop + 1) & iBucketMask;
+	//Thread hasn't stored any stats yet
+	if (iTimestamp == 0)
+		return;
+
+	if (t.iFirstStamp == 0)
+		t.iFirstStamp = iTimestamp;
+
+	//Threads store their stats every few hashes, each new sample gives us the average time per hash since the last one
+	if (t.oLatest.iTimestamp != 0 && iTimestamp > t.oLatest.iTimestamp && iHashCount > t.oLatest.iHashCount)
+	{
+		float fLat = float(iTimestamp - t.oLatest.iTimestamp) / float(iHashCount - t.oLatest.iHashCount);
+
+		//Smoothed mean deviation between consecutive values, the same estimator RTP uses
+		if (t.iLatencyCnt != 0)
+		{
+			float fPrev = t.fLatency[(t.iLatencyTop + iLatencySize - 1) % iLatencySize];
+			t.fJitter += (std::fabs(fLat - fPrev) - t.fJitter) / 16.0;
+		}
+
+		if (t.iLatencyCnt == iLatencySize)
+			t.iLatencyHist[latency_bucket(t.fLatency[t.iLatencyTop])]--;
+		t.iLatencyHist[latency_bucket(fLat)]++;
+
+		t.fLatency[t.iLatencyTop] = fLat;
+		t.iLatencyTop = (t.iLatencyTop + 1) % iLatencySize;
+		if (t.iLatencyCnt < iLatencySize)
+			t.iLatencyCnt++;
+	}
+
+	t.oLatest.iHashCount = iHashCount;
+	t.oLatest.iTimestamp = iTimestamp;
+
+	for (size_t l = 0; l < iLevelCnt; l++)
+	{
+		uint64_t iBucket = iTimestamp / level_ms(l);
+		perf_sample& smp = t.oRollup[l][iBucket & iRollupMask];
+
+		//Keep the first sample of every bucket
+		if (smp.iTimestamp != 0 && smp.iBucket == iBucket)
+			continue;
+
+		smp.iBucket = iBucket;
+		smp.iHashCount = iHashCount;
+		smp.iTimestamp = iTimestamp;
+	}
 }
 
+static const size_t MAX_N = CN_MAX_N;
+
 minethd::minethd(miner_work& pWork, size_t iNo, int iMultiway, bool no_prefetch, int64_t affinity)
 {
 	oWork = pWork;
-	bQuit = 0;
-	iThreadNo = (uint8_t)iNo;
-	iJobNo = 0;
+	bQuit = false;
+	iThreadNo = (uint32_t)iNo;
+	iJobNo = iGlobalJobNo.load(std::memory_order_relaxed);
 	iHashCount = 0;
 	iTimestamp = 0;
+	iStarvedMs = 0;
+	iCtxCnt = 0;
+	iCtxLargePage = 0;
+	iCtxLocked = 0;
+	iCtxPages = iNoCtxPages;
 	bNoPrefetch = no_prefetch;
 	this->affinity = affinity;
 
-	switch (iMultiway)
-	{
-	case 5:
-		oWorkThd = std::thread(&minethd::penta_work_main, this);
-		break;
-	case 4:
-		oWorkThd = std::thread(&minethd::quad_work_main, this);
-		break;
-	case 3:
-		oWorkThd = std::thread(&minethd::triple_work_main, this);
-		break;
-	case 2:
-		oWorkThd = std::thread(&minethd::double_work_main, this);
-		break;
-	case 1:
-	default:
+	if (iMultiway > 1)
+		oWorkThd = std::thread(&minethd::multiway_work_main, this, size_t(iMultiway) > MAX_N ? MAX_N : size_t(iMultiway));
+	else
 		oWorkThd = std::thread(&minethd::work_main, this);
-		break;
-	}
 }
 
 std::atomic<uint64_t> minethd::iGlobalJobNo;
-std::atomic<uint64_t> minethd::iConsumeCnt; //Threads get jobs as they are initialized
+std::mutex minethd::oWorkMtx;
+std::condition_variable minethd::oWorkCv;
 minethd::miner_work minethd::oGlobalWork;
-uint64_t minethd::iThreadCount = 0;
 
-cryptonight_ctx* minethd_alloc_ctx()
+cryptonight_ctx* minethd_alloc_ctx(int64_t iCpuAff)
 {
-	cryptonight_ctx* ctx;
+	cryptonight_ctx* ctx = ctx_arena::inst()->alloc_ctx(iCpuAff);
 	alloc_msg msg = { 0 };
 
+	if(ctx != nullptr)
+		return ctx;
+
 	switch (jconf::inst()->GetSlowMemSetting())
 	{
 	case jconf::never_use:
 		ctx = cryptonight_alloc_ctx(1, 1, &msg);
 		if (ctx == NULL)
 			printer::inst()->print_msg(L0, "MEMORY ALLOC FAILED: %s", msg.warning);
-		return ctx;
+		break;
 
 	case jconf::no_mlck:
 		ctx = cryptonight_alloc_ctx(1, 0, &msg);
 		if (ctx == NULL)
 			printer::inst()->print_msg(L0, "MEMORY ALLOC FAILED: %s", msg.warning);
-		return ctx;
+		break;
 
 	case jconf::print_warning:
 		ctx = cryptonight_alloc_ctx(1, 1, &msg);
@@ -212,19 +334,29 @@ cryptonight_ctx* minethd_alloc_ctx()
 			printer::inst()->print_msg(L0, "MEMORY ALLOC FAILED: %s", msg.warning);
 		if (ctx == NULL)
 			ctx = cryptonight_alloc_ctx(0, 0, NULL);
-		return ctx;
+		break;
 
 	case jconf::always_use:
-		return cryptonight_alloc_ctx(0, 0, NULL);
+		ctx = cryptonight_alloc_ctx(0, 0, NULL);
+		break;
 
 	case jconf::unknown_value:
 		return NULL; //Shut up compiler
 	}
 
-	return nullptr; //Should never happen
+	// Keep it for the next thread instead of giving the pages back to the kernel
+	if(ctx != nullptr)
+		ctx_arena::inst()->adopt_ctx(ctx, iCpuAff);
+
+	return ctx;
+}
+
+void minethd_free_ctx(cryptonight_ctx* ctx)
+{
+	if(!ctx_arena::inst()->free_ctx(ctx))
+		cryptonight_free_ctx(ctx);
 }
 
-static const size_t MAX_N = 5;
 bool minethd::self_test()
 {
 	alloc_msg msg = { 0 };
@@ -268,7 +400,7 @@ bool minethd::self_test()
 		if ((ctx[i] = minethd_alloc_ctx()) == nullptr)
 		{
 			for (int j = 0; j < i; j++)
-				cryptonight_free_ctx(ctx[j]);
+				minethd_free_ctx(ctx[j]);
 			return false;
 		}
 	}
@@ -277,43 +409,76 @@ bool minethd::self_test()
 	bool bResult;
 
 	cn_hash_fun hashf;
+	const char* sTestHash = "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05";
 
-	hashf = func_selector(1, jconf::inst()->HaveHardwareAes(), false);
+	hashf = func_selector(1, jconf::inst()->GetKernelIsa(), false);
 	hashf("This is a test", 14, out, ctx);
-	bResult = memcmp(out, "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05", 32) == 0;
+	bResult = memcmp(out, sTestHash, 32) == 0;
 
-	hashf = func_selector(1, jconf::inst()->HaveHardwareAes(), true);
+	hashf = func_selector(1, jconf::inst()->GetKernelIsa(), true);
 	hashf("This is a test", 14, out, ctx);
-	bResult &= memcmp(out, "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05", 32) == 0;
+	bResult &= memcmp(out, sTestHash, 32) == 0;
 
-	hashf = func_selector(2, jconf::inst()->HaveHardwareAes(), false);
+	hashf = func_selector(2, jconf::inst()->GetKernelIsa(), false);
 	hashf("The quick brown fox jumps over the lazy dogThe quick brown fox jumps over the lazy log", 43, out, ctx);
 	bResult &= memcmp(out, "\x3e\xbb\x7f\x9f\x7d\x27\x3d\x7c\x31\x8d\x86\x94\x77\x55\x0c\xc8\x00\xcf\xb1\x1b\x0c\xad\xb7\xff\xbd\xf6\xf8\x9f\x3a\x47\x1c\x59"
 		                   "\xb4\x77\xd5\x02\xe4\xd8\x48\x7f\x42\xdf\xe3\x8e\xed\x73\x81\x7a\xda\x91\xb7\xe2\x63\xd2\x91\x71\xb6\x5c\x44\x3a\x01\x2a\x41\x22", 64) == 0;
 
-	hashf = func_selector(3, jconf::inst()->HaveHardwareAes(), false);
-	hashf("This is a testThis is a testThis is a test", 14, out, ctx);
-	bResult &= memcmp(out, "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05", 96) == 0;
-
-	hashf = func_selector(4, jconf::inst()->HaveHardwareAes(), false);
-	hashf("This is a testThis is a testThis is a testThis is a test", 14, out, ctx);
-	bResult &= memcmp(out, "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05", 128) == 0;
-
-	hashf = func_selector(5, jconf::inst()->HaveHardwareAes(), false);
-	hashf("This is a testThis is a testThis is a testThis is a testThis is a test", 14, out, ctx);
-	bResult &= memcmp(out, "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05"
-		                   "\xa0\x84\xf0\x1d\x14\x37\xa0\x9c\x69\x85\x40\x1b\x60\xd4\x35\x54\xae\x10\x58\x02\xc5\xf5\xd8\xa9\xb3\x25\x36\x49\xc0\xbe\x66\x05", 160) == 0;
+	// Every multiway kernel from 3 up has to give each lane the single hash of its own input.
+	// Lane 0 is the test vector, the others differ in the last byte so a mixed up lane shows.
+	char sTestInput[14 * MAX_N];
+	unsigned char sLaneHash[32 * MAX_N];
+	hashf = func_selector(1, jconf::inst()->GetKernelIsa(), false);
+	for (size_t i = 0; i < MAX_N; i++)
+	{
+		memcpy(sTestInput + 14 * i, "This is a test", 14);
+		sTestInput[14 * i + 13] += (char)i;
+		hashf(sTestInput + 14 * i, 14, sLaneHash + 32 * i, ctx);
+	}
+	bResult &= memcmp(sLaneHash, sTestHash, 32) == 0;
+
+	for (size_t n = 3; n <= MAX_N; n++)
+	{
+		hashf = func_selector(n, jconf::inst()->GetKernelIsa(), false);
+		hashf(sTestInput, 14, out, ctx);
+		bResult &= memcmp(out, sLaneHash, 32 * n) == 0;
+	}
+
+	// The lane-parallel Keccak at both ends of a multiway hash, with a different input in every lane
+	bResult &= cn_keccak_self_test(jconf::inst()->GetKernelIsa(), ctx);
+	// The sample hash above only reaches one of the four final hashes
+	bResult &= cn_extra_hash_self_test(jconf::inst()->GetKernelIsa());
+
+	// The pipelined kernels are exactly one call behind, multiway_work_main credits their output to
+	// the previous nonces. Every lane of every call gets its own nonce, so call k has to give back
+	// the single hashes of call k-1 lane by lane. They are checked whatever multiway_pipeline says,
+	// --bench-kernels runs them too.
+	constexpr size_t iPipeCalls = 3;
+	unsigned char bPipeInput[iPipeCalls][76 * MAX_N] = {{0}};
+	unsigned char bPipeHash[iPipeCalls][32 * MAX_N];
+	hashf = func_selector(1, jconf::inst()->GetKernelIsa(), false);
+	for (size_t k = 0; k < iPipeCalls; k++)
+	{
+		for (size_t i = 0; i < MAX_N; i++)
+		{
+			bPipeInput[k][76 * i + 39] = (unsigned char)(k * MAX_N + i + 1);
+			hashf(bPipeInput[k] + 76 * i, 76, bPipeHash[k] + 32 * i, ctx);
+		}
+	}
+
+	for (size_t n = 2; n <= MAX_N; n++)
+	{
+		hashf = func_selector(n, jconf::inst()->GetKernelIsa(), false, true);
+		for (size_t k = 0; k < iPipeCalls; k++)
+		{
+			hashf(bPipeInput[k], 76, out, ctx);
+			if (k > 0)
+				bResult &= memcmp(out, bPipeHash[k - 1], 32 * n) == 0;
+		}
+	}
 
 	for (int i = 0; i < MAX_N; i++)
-		cryptonight_free_ctx(ctx[i]);
+		minethd_free_ctx(ctx[i]);
 
 	if(!bResult)
 		printer::inst()->print_msg(L0,
@@ -324,91 +489,154 @@ bool minethd::self_test()
 
 std::vector<minethd*>* minethd::thread_starter(miner_work& pWork)
 {
+	size_t i, n = jconf::inst()->GetThreadCount();
+	std::vector<jconf::thd_cfg> vCfg(n);
+
+	for (i = 0; i < n; i++)
+		jconf::inst()->GetThreadConfig(i, vCfg[i]);
+
+	return thread_starter(pWork, vCfg);
+}
+
+std::vector<minethd*>* minethd::thread_starter(miner_work& pWork, const std::vector<jconf::thd_cfg>& vCfg)
+{
+	// The threads start on pWork, it has to be published like any other job for them to claim nonces
 	iGlobalJobNo = 0;
-	iConsumeCnt = 0;
+	switch_work(pWork);
 	std::vector<minethd*>* pvThreads = new std::vector<minethd*>;
 
 	//Launch the requested number of single and double threads, to distribute
 	//load evenly we need to alternate single and double threads
-	size_t i, n = jconf::inst()->GetThreadCount();
+	size_t i, n = vCfg.size();
 	pvThreads->reserve(n);
 
-	jconf::thd_cfg cfg;
+	ctx_arena::inst()->reserve(vCfg);
+
 	for (i = 0; i < n; i++)
 	{
-		jconf::inst()->GetThreadConfig(i, cfg);
+		const jconf::thd_cfg& cfg = vCfg[i];
 
 		minethd* thd = new minethd(pWork, i, cfg.iMultiway, cfg.bNoPrefetch, cfg.iCpuAff);
 
 		pvThreads->push_back(thd);
 
-		if(cfg.iCpuAff >= 0)
+		if(cfg.iCpuAff >= 0 && topology::inst()->pu_node(cfg.iCpuAff) >= 0)
+			printer::inst()->print_msg(L1, "Starting %dx thread, affinity: %d (NUMA node %d, L3 %d).", cfg.iMultiway, (int)cfg.iCpuAff,
+				(int)topology::inst()->pu_node(cfg.iCpuAff), (int)topology::inst()->pu_l3(cfg.iCpuAff));
+		else if(cfg.iCpuAff >= 0)
 			printer::inst()->print_msg(L1, "Starting %dx thread, affinity: %d.", cfg.iMultiway, (int)cfg.iCpuAff);
 		else
 			printer::inst()->print_msg(L1, "Starting %dx thread, no affinity.", cfg.iMultiway);
 	}
 
-	iThreadCount = n;
 	return pvThreads;
 }
 
+void minethd::thread_stopper(std::vector<minethd*>* pvThreads)
+{
+	for (minethd* thd : *pvThreads)
+		thd->bQuit = true;
+
+	// Threads only look at bQuit when they pick up a new job
+	miner_work oWork = miner_work();
+	switch_work(oWork);
+
+	for (minethd* thd : *pvThreads)
+	{
+		thd->oWorkThd.join();
+		delete thd;
+	}
+
+	delete pvThreads;
+}
+
 void minethd::switch_work(miner_work& pWork)
 {
-	// iConsumeCnt is a basic lock-like polling mechanism just in case we happen to push work
-	// faster than threads can consume them. This should never happen in real life.
-	// Pool cant physically send jobs faster than every 250ms or so due to net latency.
+	// oGlobalWork is a seqlock guarded by iGlobalJobNo. The number is odd while we are
+	// writing the job and even when it is stable, so publishing never waits for the
+	// workers. A worker that is too slow to see a job simply picks up the next one.
+	// There must only ever be one writer - the executor thread (or main in benchmarks).
+	uint64_t iSeq = iGlobalJobNo.load(std::memory_order_relaxed);
+
+	// Nonces are claimed by job number, the allocator has to know it before any thread does
+	nonce_alloc::inst()->new_job(iSeq + 2, pWork.iPoolId, pWork.sJobID, (uint32_t*)(pWork.bWorkBlob + 39),
+		pWork.bNiceHash, pWork.bStall);
 
-	while (iConsumeCnt.load(std::memory_order_seq_cst) < iThreadCount)
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	iGlobalJobNo.store(iSeq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
 
 	oGlobalWork = pWork;
-	iConsumeCnt.store(0, std::memory_order_seq_cst);
-	iGlobalJobNo++;
+
+	iGlobalJobNo.store(iSeq + 2, std::memory_order_release);
+
+	// Stalled threads sleep on the condition variable. Taking the mutex here means a thread
+	// can't check the job number, miss the store above and then go to sleep. It is only
+	// ever held for that check, so this won't keep us waiting.
+	{
+		std::lock_guard<std::mutex> lck(oWorkMtx);
+	}
+	oWorkCv.notify_all();
+}
+
+bool minethd::claim_nonces(uint32_t iMin, uint64_t& iNonce, uint64_t& iNonceEnd)
+{
+	nonce_alloc::inst()->release(iJobNo, iNonce, iNonceEnd);
+	iNonce = iNonceEnd = 0;
+
+	if(nonce_alloc::inst()->claim(iJobNo, iMin, iNonce, iNonceEnd))
+		return true;
+
+	// The job ran out of nonces or was just replaced, nothing to hash until the next one
+	wait_for_work();
+	return false;
+}
+
+void minethd::wait_for_work()
+{
+	using namespace std::chrono;
+	steady_clock::time_point tStart = steady_clock::now();
+
+	std::unique_lock<std::mutex> lck(oWorkMtx);
+	oWorkCv.wait(lck, [this] { return iGlobalJobNo.load(std::memory_order_relaxed) != iJobNo; });
+	lck.unlock();
+
+	uint64_t iMs = duration_cast<milliseconds>(steady_clock::now() - tStart).count();
+	iStarvedMs.fetch_add(iMs, std::memory_order_relaxed);
 }
 
 void minethd::consume_work()
 {
-	memcpy(&oWork, &oGlobalWork, sizeof(miner_work));
-	iJobNo++;
-	iConsumeCnt++;
+	uint64_t iSeq;
+
+	while(true)
+	{
+		iSeq = iGlobalJobNo.load(std::memory_order_acquire);
+
+		// Writer is in the middle of a job, it is a couple of hundred bytes so this will be quick
+		if((iSeq & 1) != 0)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		// Copy the whole struct, a torn read of iWorkSize mustn't make us copy out of bounds
+		memcpy(&oWork, &oGlobalWork, sizeof(miner_work));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(iGlobalJobNo.load(std::memory_order_relaxed) == iSeq)
+			break;
+	}
+
+	iJobNo = iSeq;
 }
 
-minethd::cn_hash_fun minethd::func_selector(size_t N, bool bHaveAes, bool bNoPrefetch)
+cn_hash_fun minethd::func_selector(size_t N, cn_isa isa, bool bNoPrefetch, bool bPipeline)
 {
-	// We have two independent flag bits in the functions
-	// therefore we will build a binary digit and select the
-	// function as a two digit binary
-	// Digit order SOFT_AES, NO_PREFETCH
-
-	static const cn_hash_fun func_table[4 * MAX_N] = {
-		cryptonight_hash<0x80000, MEMORY, false, false>,
-		cryptonight_hash<0x80000, MEMORY, false, true>,
-		cryptonight_hash<0x80000, MEMORY, true, false>,
-		cryptonight_hash<0x80000, MEMORY, true, true>,
-		cryptonight_double_hash<0x80000, MEMORY, false, false>,
-		cryptonight_double_hash<0x80000, MEMORY, false, true>,
-		cryptonight_double_hash<0x80000, MEMORY, true, false>,
-		cryptonight_double_hash<0x80000, MEMORY, true, true>,
-		cryptonight_triple_hash<0x80000, MEMORY, false, false>,
-		cryptonight_triple_hash<0x80000, MEMORY, false, true>,
-		cryptonight_triple_hash<0x80000, MEMORY, true, false>,
-		cryptonight_triple_hash<0x80000, MEMORY, true, true>,
-		cryptonight_quad_hash<0x80000, MEMORY, false, false>,
-		cryptonight_quad_hash<0x80000, MEMORY, false, true>,
-		cryptonight_quad_hash<0x80000, MEMORY, true, false>,
-		cryptonight_quad_hash<0x80000, MEMORY, true, true>,
-		cryptonight_penta_hash<0x80000, MEMORY, false, false>,
-		cryptonight_penta_hash<0x80000, MEMORY, false, true>,
-		cryptonight_penta_hash<0x80000, MEMORY, true, false>,
-		cryptonight_penta_hash<0x80000, MEMORY, true, true>,
-	};
-
-	std::bitset<2> digit;
-	digit.set(0, !bNoPrefetch);
-	digit.set(1, !bHaveAes);
-
-	N = (N < 1) ? 1 : (N > MAX_N) ? MAX_N : N;
-	return func_table[4 * (N - 1) + digit.to_ulong()];
+	// Every ISA level is a separate translation unit with its own table,
+	// cryptonight_common.cpp falls back to a lower level if one wasn't compiled in
+	if(bPipeline && N >= 2)
+		return cn_select_pipe_kernel(isa, N, bNoPrefetch);
+	return cn_select_kernel(isa, N, bNoPrefetch);
 }
 
 void minethd::pin_thd_affinity()
@@ -422,6 +650,31 @@ void minethd::pin_thd_affinity()
 	thd_setaffinity(oWorkThd.native_handle(), affinity);
 }
 
+void minethd::count_ctx(const cryptonight_ctx* ctx)
+{
+	if(ctx == nullptr)
+		return;
+
+	iCtxCnt++;
+	if(ctx->ctx_info[0] != 0)
+		iCtxLargePage++;
+	if(ctx->ctx_info[0] != 0 && ctx->ctx_info[1] != 0)
+		iCtxLocked++;
+	if(ctx->ctx_info[5] < iCtxPages)
+		iCtxPages = ctx->ctx_info[5];
+}
+
+void minethd::apply_sched()
+{
+	jconf::sched_cfg policy = jconf::inst()->GetSchedPolicy();
+	int nice = jconf::inst()->GetNiceLevel();
+
+	iYieldEvery = jconf::inst()->GetYieldEvery();
+
+	if(!thd_setsched(policy, nice))
+		printer::inst()->print_msg(L1, "WARNING: Thread %u couldn't set the scheduling policy or nice level.", (unsigned int)iThreadNo);
+}
+
 void minethd::work_main()
 {
 	if(affinity >= 0) //-1 means no affinity
@@ -430,16 +683,22 @@ void minethd::work_main()
 	cn_hash_fun hash_fun;
 	cryptonight_ctx* ctx;
 	uint64_t iCount = 0;
+	uint64_t iSinceYield = 0;
 	uint64_t* piHashVal;
 	uint32_t* piNonce;
 	job_result result;
 
-	hash_fun = func_selector(1, jconf::inst()->HaveHardwareAes(), bNoPrefetch);
-	ctx = minethd_alloc_ctx();
+	apply_sched();
+	hash_fun = func_selector(1, jconf::inst()->GetKernelIsa(), bNoPrefetch);
+	ctx = minethd_alloc_ctx(affinity);
+	// MEMORY ALLOC FAILED is already printed, with use_slow_memory never that leaves nothing to do
+	if(ctx == nullptr)
+		return;
+	count_ctx(ctx);
+	ctx->cancel_epoch = &iGlobalJobNo;
 
 	piHashVal = (uint64_t*)(result.bResult + 24);
 	piNonce = (uint32_t*)(oWork.bWorkBlob + 39);
-	iConsumeCnt++;
 
 	while (bQuit == 0)
 	{
@@ -449,23 +708,23 @@ void minethd::work_main()
 			    either because of network latency, or a socket problem. Since we are
 			    raison d'etre of this software it us sensible to just wait until we have something*/
 
-			while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
-				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			wait_for_work();
 
 			consume_work();
 			continue;
 		}
 
-		if(oWork.bNiceHash)
-			result.iNonce = calc_nicehash_nonce(*piNonce, oWork.iResumeCnt);
-		else
-			result.iNonce = calc_start_nonce(oWork.iResumeCnt);
+		uint64_t iNonce = 0, iNonceEnd = 0;
+		ctx->epoch = iJobNo;
 
 		assert(sizeof(job_result::sJobID) == sizeof(pool_job::sJobID));
 		memcpy(result.sJobID, oWork.sJobID, sizeof(job_result::sJobID));
 
 		while(iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
 		{
+			if(iNonce == iNonceEnd && !claim_nonces(1, iNonce, iNonceEnd))
+				break;
+
 			if ((iCount & 0xF) == 0) //Store stats every 16 hashes
 			{
 				using namespace std::chrono;
@@ -475,64 +734,71 @@ void minethd::work_main()
 			}
 			iCount++;
 
-			*piNonce = ++result.iNonce;
+			result.iNonce = (uint32_t)iNonce++;
+			*piNonce = result.iNonce;
 
 			hash_fun(oWork.bWorkBlob, oWork.iWorkSize, result.bResult, &ctx);
 
+			// The job changed halfway through, the result is garbage and the nonce goes back with the claim
+			if (ctx->cancelled)
+			{
+				ctx->cancelled = 0;
+				iNonce--;
+				iCount--;
+				break;
+			}
+
 			if (*piHashVal < oWork.iTarget)
 				executor::inst()->push_event(ex_event(result, oWork.iPoolId));
 
-			std::this_thread::yield();
+			if (iYieldEvery != 0 && ++iSinceYield >= iYieldEvery)
+			{
+				iSinceYield = 0;
+				std::this_thread::yield();
+			}
 		}
 
+		nonce_alloc::inst()->release(iJobNo, iNonce, iNonceEnd);
 		consume_work();
 	}
 
-	cryptonight_free_ctx(ctx);
-}
-
-void minethd::double_work_main()
-{
-	multiway_work_main(2, func_selector(2, jconf::inst()->HaveHardwareAes(), bNoPrefetch));
-}
-
-void minethd::triple_work_main()
-{
-	multiway_work_main(3, func_selector(3, jconf::inst()->HaveHardwareAes(), bNoPrefetch));
+	minethd_free_ctx(ctx);
 }
 
-void minethd::quad_work_main()
-{
-	multiway_work_main(4, func_selector(4, jconf::inst()->HaveHardwareAes(), bNoPrefetch));
-}
-
-void minethd::penta_work_main()
-{
-	multiway_work_main(5, func_selector(5, jconf::inst()->HaveHardwareAes(), bNoPrefetch));
-}
-
-void minethd::multiway_work_main(size_t N, cn_hash_fun hash_fun)
+void minethd::multiway_work_main(size_t N)
 {
 	if(affinity >= 0) //-1 means no affinity
 		pin_thd_affinity();
 
+	apply_sched();
+	bool bPipeline = jconf::inst()->MultiwayPipeline();
+	cn_hash_fun hash_fun = func_selector(N, jconf::inst()->GetKernelIsa(), bNoPrefetch, bPipeline);
+
 	cryptonight_ctx *ctx[MAX_N];
 	uint64_t iCount = 0;
+	uint64_t iSinceYield = 0;
 	uint64_t *piHashVal[MAX_N];
 	uint32_t *piNonce[MAX_N];
 	uint8_t bHashOut[MAX_N * 32];
 	uint8_t bWorkBlob[sizeof(miner_work::bWorkBlob) * MAX_N];
-	uint32_t iNonce;
 	job_result res;
 
 	for (size_t i = 0; i < N; i++)
 	{
-		ctx[i] = minethd_alloc_ctx();
+		ctx[i] = minethd_alloc_ctx(affinity);
+		if (ctx[i] == nullptr)
+		{
+			for (size_t j = 0; j < i; j++)
+				minethd_free_ctx(ctx[j]);
+			return;
+		}
 		piHashVal[i] = (uint64_t*)(bHashOut + 32 * i + 24);
 		piNonce[i] = (i == 0) ? (uint32_t*)(bWorkBlob + 39) : nullptr;
 	}
 
-	iConsumeCnt++;
+	for (size_t i = 0; i < N; i++)
+		count_ctx(ctx[i]);
+	ctx[0]->cancel_epoch = &iGlobalJobNo;
 
 	while (bQuit == 0)
 	{
@@ -542,8 +808,7 @@ void minethd::multiway_work_main(size_t N, cn_hash_fun hash_fun)
 			either because of network latency, or a socket problem. Since we are
 			raison d'etre of this software it us sensible to just wait until we have something*/
 
-			while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
-				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			wait_for_work();
 
 			consume_work();
 			for (size_t i = 0; i < N; i++)
@@ -554,15 +819,21 @@ void minethd::multiway_work_main(size_t N, cn_hash_fun hash_fun)
 			continue;
 		}
 
-		if(oWork.bNiceHash)
-			iNonce = calc_nicehash_nonce(*piNonce[0], oWork.iResumeCnt);
-		else
-			iNonce = calc_start_nonce(oWork.iResumeCnt);
+		uint64_t iNonce = 0, iNonceEnd = 0;
+		// The pipelined kernel hands back the hashes of the previous call, these are their nonces.
+		// Whatever is still in the pipeline from another job or from before a cancellation is garbage.
+		uint64_t iPrevNonce = 0;
+		bool bPrevValid = false;
+		ctx[0]->epoch = iJobNo;
 
 		assert(sizeof(job_result::sJobID) == sizeof(pool_job::sJobID));
 
 		while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
 		{
+			// Every lane needs a nonce of the same claim
+			if (iNonceEnd - iNonce < N && !claim_nonces(N, iNonce, iNonceEnd))
+				break;
+
 			if ((iCount & 0x3) == 0)  //Store stats every N*4 hashes
 			{
 				using namespace std::chrono;
@@ -574,17 +845,46 @@ void minethd::multiway_work_main(size_t N, cn_hash_fun hash_fun)
 			iCount += N;
 
 			for (size_t i = 0; i < N; i++)
-				if (piNonce[i]) *piNonce[i] = ++iNonce;
+				if (piNonce[i]) *piNonce[i] = (uint32_t)(iNonce + i);
 
 			hash_fun(bWorkBlob, oWork.iWorkSize, bHashOut, ctx);
 
-			for (size_t i = 0; i < N; i++)
+			// The job changed halfway through, drop the whole batch
+			if (ctx[0]->cancelled)
+			{
+				ctx[0]->cancelled = 0;
+				iCount -= N;
+				break;
+			}
+
+			uint64_t iOutNonce = iNonce;
+			bool bOutValid = true;
+			if (bPipeline)
+			{
+				iOutNonce = iPrevNonce;
+				bOutValid = bPrevValid;
+				iPrevNonce = iNonce;
+				bPrevValid = true;
+			}
+
+			for (size_t i = 0; bOutValid && i < N; i++)
 				if (*piHashVal[i] < oWork.iTarget)
-					executor::inst()->push_event(ex_event(job_result(oWork.sJobID, iNonce - N + 1 + i, bHashOut + 32 * i), oWork.iPoolId));
+					executor::inst()->push_event(ex_event(job_result(oWork.sJobID, (uint32_t)(iOutNonce + i), bHashOut + 32 * i), oWork.iPoolId));
 
-			std::this_thread::yield();
+			iNonce += N;
+
+			iSinceYield += N;
+			if (iYieldEvery != 0 && iSinceYield >= iYieldEvery)
+			{
+				iSinceYield = 0;
+				std::this_thread::yield();
+			}
 		}
 
+		nonce_alloc::inst()->release(iJobNo, iNonce, iNonceEnd);
+		// Hashed, but nobody will look at the result any more
+		if (bPrevValid)
+			nonce_alloc::inst()->release(iJobNo, iPrevNonce, iPrevNonce + N);
 		consume_work();
 		for (size_t i = 0; i < N; i++)
 		{
@@ -594,5 +894,5 @@ void minethd::multiway_work_main(size_t N, cn_hash_fun hash_fun)
 	}
 
 	for (int i = 0; i < N; i++)
-		cryptonight_free_ctx(ctx[i]);
+		minethd_free_ctx(ctx[i]);
 }
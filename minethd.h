@@ -1,7 +1,10 @@
 #pragma once
 #include <thread>
 #include <atomic>
-#include "crypto/cryptonight.h"
+#include <mutex>
+#include <condition_variable>
+#include "crypto/cryptonight_kernels.h"
+#include "jconf.h"
 
 class telemetry
 {
@@ -9,15 +12,57 @@ public:
 	telemetry(size_t iThd);
 	void push_perf_value(size_t iThd, uint64_t iHashCount, uint64_t iTimestamp);
 	double calc_telemetry_data(size_t iLastMilisec, size_t iThread);
+	// Per-hash time in ms (median, 99th percentile) and its jitter, NaN until we have data.
+	// iThread == iThdCnt gives the percentiles over all threads together.
+	void calc_latency(size_t iThread, double& fP50, double& fP99, double& fJitter);
 
 private:
-	constexpr static size_t iBucketSize = 2 << 11; //Power of 2 to simplify calculations
-	constexpr static size_t iBucketMask = iBucketSize - 1;
-	uint32_t* iBucketTop;
-	uint64_t** ppHashCounts;
-	uint64_t** ppTimestamps;
+	// Hash counter samples are rolled up at 1s, 10s and 60s granularity. Every level keeps
+	// the first sample of each bucket, so a report finds the start of its window by index
+	// instead of walking every sample.
+	constexpr static size_t iLevelCnt = 3;
+	constexpr static size_t iRollupSize = 64; //Power of 2 to simplify calculations
+	constexpr static size_t iRollupMask = iRollupSize - 1;
+	constexpr static size_t iLatencySize = 128;
+	// Histogram of the values in fLatency, 16 buckets per octave from 1/16 ms up to 4096 ms.
+	// Percentiles are read from it, their error is below 2.2%.
+	constexpr static size_t iLatencyBuckets = 256;
+	constexpr static int iLatencyZeroBucket = 64; // Bucket of 1 ms
+
+	static uint64_t level_ms(size_t iLevel) { return iLevel == 0 ? 1000 : (iLevel == 1 ? 10000 : 60000); }
+	static size_t latency_bucket(float fLat);
+
+	struct perf_sample
+	{
+		uint64_t iBucket;
+		uint64_t iHashCount;
+		uint64_t iTimestamp;
+	};
+
+	struct thd_telemetry
+	{
+		perf_sample oRollup[iLevelCnt][iRollupSize];
+		perf_sample oLatest;
+		uint64_t iFirstStamp;
+
+		float fLatency[iLatencySize];
+		size_t iLatencyTop;
+		size_t iLatencyCnt;
+		uint8_t iLatencyHist[iLatencyBuckets];
+		double fJitter;
+	};
+
+	size_t iThdCnt;
+	thd_telemetry* pThd;
 };
 
+// Takes a scratchpad from the arena if there is one left on the CPU's NUMA node
+cryptonight_ctx* minethd_alloc_ctx(int64_t iCpuAff = -1);
+void minethd_free_ctx(cryptonight_ctx* ctx);
+void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id);
+// Applies a scheduling policy and nice level to the calling thread, false if the OS refused
+bool thd_setsched(jconf::sched_cfg policy, int nice);
+
 class minethd
 {
 public:
@@ -92,51 +137,54 @@ public:
 
 	static void switch_work(miner_work& pWork);
 	static std::vector<minethd*>* thread_starter(miner_work& pWork);
+	static std::vector<minethd*>* thread_starter(miner_work& pWork, const std::vector<jconf::thd_cfg>& vCfg);
+	// Stops and joins all threads, then deletes them and the vector
+	static void thread_stopper(std::vector<minethd*>* pvThreads);
 	static bool self_test();
 
 	std::atomic<uint64_t> iHashCount;
 	std::atomic<uint64_t> iTimestamp;
+	// Total time in ms the thread spent stalled, waiting for a job
+	std::atomic<uint64_t> iStarvedMs;
+	// Scratchpads the thread allocated, how many of them are on large pages and locked in memory
+	std::atomic<uint32_t> iCtxCnt;
+	std::atomic<uint32_t> iCtxLargePage;
+	std::atomic<uint32_t> iCtxLocked;
+	// Smallest page size (CTX_PAGES_*) among the thread's scratchpads, iNoCtxPages before it has any
+	std::atomic<uint8_t> iCtxPages;
+	constexpr static uint8_t iNoCtxPages = 0xFF;
 
 private:
-	typedef void (*cn_hash_fun)(const void*, size_t, void*, cryptonight_ctx**);
 	minethd(miner_work& pWork, size_t iNo, int iMultiway, bool no_prefetch, int64_t affinity);
 
-	// We use the top 10 bits of the nonce for thread and resume
-	// This allows us to resume up to 128 threads 4 times before
-	// we get nonce collisions
-	// Bottom 22 bits allow for an hour of work at 1000 H/s
-	inline uint32_t calc_start_nonce(uint32_t resume)
-		{ return (resume * iThreadCount + iThreadNo) << 22; }
-
-	// Limited version of the nonce calc above
-	inline uint32_t calc_nicehash_nonce(uint32_t start, uint32_t resume)
-		{ return start | (resume * iThreadCount + iThreadNo) << 18; }
-
-	static cn_hash_fun func_selector(size_t N, bool bHaveAes, bool bNoPrefetch);
-	void multiway_work_main(size_t N, cn_hash_fun hash_fun);
+	static cn_hash_fun func_selector(size_t N, cn_isa isa, bool bNoPrefetch, bool bPipeline = false);
+	void multiway_work_main(size_t N);
 
 	void work_main();
-	void double_work_main();
-	void triple_work_main();
-	void quad_work_main();
-	void penta_work_main();
 	void consume_work();
+	void wait_for_work();
+	// Swaps the rest of [iNonce, iNonceEnd) for a fresh claim of at least iMin nonces. If there
+	// are none, waits for the next job and returns false.
+	bool claim_nonces(uint32_t iMin, uint64_t& iNonce, uint64_t& iNonceEnd);
 
 	static std::atomic<uint64_t> iGlobalJobNo;
-	static std::atomic<uint64_t> iConsumeCnt;
-	static uint64_t iThreadCount;
+	static std::mutex oWorkMtx;
+	static std::condition_variable oWorkCv;
 	uint64_t iJobNo;
 
 	static miner_work oGlobalWork;
 	miner_work oWork;
 
 	void pin_thd_affinity();
+	void apply_sched();
+	void count_ctx(const cryptonight_ctx* ctx);
+	uint64_t iYieldEvery;
 
 	std::thread oWorkThd;
-	uint8_t iThreadNo;
+	uint32_t iThreadNo;
 	int64_t affinity;
 
-	bool bQuit;
+	std::atomic<bool> bQuit;
 	bool bNoPrefetch;
 };
 
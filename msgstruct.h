@@ -13,10 +13,11 @@ struct pool_job
 	uint64_t	iTarget;
 	uint32_t	iWorkLen;
 	uint32_t	iResumeCnt;
+	uint64_t	iRecvTime; // steady_clock in ns when the job came off the wire, for latency stats
 
-	pool_job() : iWorkLen(0), iResumeCnt(0) {}
+	pool_job() : iWorkLen(0), iResumeCnt(0), iRecvTime(0) {}
 	pool_job(const char* sJobID, uint64_t iTarget, const uint8_t* bWorkBlob, uint32_t iWorkLen) :
-		iTarget(iTarget), iWorkLen(iWorkLen), iResumeCnt(0)
+		iTarget(iTarget), iWorkLen(iWorkLen), iResumeCnt(0), iRecvTime(0)
 	{
 		assert(iWorkLen <= sizeof(pool_job::bWorkBlob));
 		memcpy(this->sJobID, sJobID, sizeof(pool_job::sJobID));
@@ -38,10 +39,35 @@ struct job_result
 	}
 };
 
+// Pool's answer to an asynchronous submit, or a network error if the connection died first
+struct submit_result
+{
+	uint64_t	iCallId;
+	uint64_t	iResultDiff;
+	uint32_t	iPingMs;
+	bool		bAccepted;
+	bool		bNetError;
+	char		sError[128];
+
+	submit_result() : iCallId(0), iResultDiff(0), iPingMs(0), bAccepted(false), bNetError(true) { sError[0] = '\0'; }
+	submit_result(uint64_t iCallId, uint64_t iResultDiff, uint32_t iPingMs, const char* sErr, size_t iErrLen) :
+		iCallId(iCallId), iResultDiff(iResultDiff), iPingMs(iPingMs), bAccepted(sErr == nullptr), bNetError(false)
+	{
+		sError[0] = '\0';
+		if(sErr != nullptr)
+		{
+			if(iErrLen >= sizeof(sError))
+				iErrLen = sizeof(sError) - 1;
+			memcpy(sError, sErr, iErrLen);
+			sError[iErrLen] = '\0';
+		}
+	}
+};
+
 enum ex_event_name { EV_INVALID_VAL, EV_SOCK_READY, EV_SOCK_ERROR,
-	EV_POOL_HAVE_JOB, EV_MINER_HAVE_RESULT, EV_PERF_TICK, EV_RECONNECT,
+	EV_POOL_HAVE_JOB, EV_MINER_HAVE_RESULT, EV_POOL_SUBMIT_RESULT, EV_PERF_TICK, EV_RECONNECT,
 	EV_SWITCH_POOL, EV_DEV_POOL_EXIT, EV_USR_HASHRATE, EV_USR_RESULTS, EV_USR_CONNSTAT,
-	EV_HASHRATE_LOOP, EV_HTML_HASHRATE, EV_HTML_RESULTS, EV_HTML_CONNSTAT, EV_HTML_JSON };
+	EV_HASHRATE_LOOP, EV_HTML_HASHRATE, EV_HTML_RESULTS, EV_HTML_CONNSTAT, EV_HTML_JSON, EV_HTML_METRICS };
 
 /*
    This is how I learned to stop worrying and love c++11 =).
@@ -62,6 +88,7 @@ struct ex_event
 	{
 		pool_job oPoolJob;
 		job_result oJobResult;
+		submit_result oSubmitResult;
 		std::string sSocketError;
 	};
 
@@ -69,6 +96,7 @@ struct ex_event
 	ex_event(std::string&& err, size_t id) : iName(EV_SOCK_ERROR), iPoolId(id), sSocketError(std::move(err)) { }
 	ex_event(job_result dat, size_t id) : iName(EV_MINER_HAVE_RESULT), iPoolId(id), oJobResult(dat) {}
 	ex_event(pool_job dat, size_t id) : iName(EV_POOL_HAVE_JOB), iPoolId(id), oPoolJob(dat) {}
+	ex_event(submit_result dat, size_t id) : iName(EV_POOL_SUBMIT_RESULT), iPoolId(id), oSubmitResult(dat) {}
 	ex_event(ex_event_name ev, size_t id = 0) : iName(ev), iPoolId(id) {}
 
 	// Delete the copy operators to make sure we are moving only what is needed
@@ -91,6 +119,9 @@ struct ex_event
 		case EV_POOL_HAVE_JOB:
 			oPoolJob = from.oPoolJob;
 			break;
+		case EV_POOL_SUBMIT_RESULT:
+			oSubmitResult = from.oSubmitResult;
+			break;
 		default:
 			break;
 		}
@@ -118,6 +149,9 @@ struct ex_event
 		case EV_POOL_HAVE_JOB:
 			oPoolJob = from.oPoolJob;
 			break;
+		case EV_POOL_SUBMIT_RESULT:
+			oSubmitResult = from.oSubmitResult;
+			break;
 		default:
 			break;
 		}
@@ -0,0 +1,162 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+
+#include <string.h>
+
+#include "nonce_alloc.h"
+#include "console.h"
+
+nonce_alloc* nonce_alloc::oInst = nullptr;
+
+// Nonces a thread takes at a time, a couple of seconds of work at the very least
+constexpr uint32_t iBlockSize = 4096;
+// Jobs we remember for resumes
+constexpr size_t iMaxJobs = 8;
+
+uint64_t nonce_alloc::job_size(const job_space& job)
+{
+	return job.bNiceHash ? (uint64_t(1) << 24) : (uint64_t(1) << 32);
+}
+
+void nonce_alloc::new_job(uint64_t iJobNo, size_t iPoolId, const char* sJobID, const uint32_t* piNonce, bool bNiceHash, bool bStall)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+
+	if(bStall)
+	{
+		iCurrentJobNo = 0;
+		return;
+	}
+
+	// The pool's part of the nonce, a NiceHash pool gives every miner its own top byte
+	uint32_t iPrefix = bNiceHash ? (*piNonce & 0xFF000000) : 0;
+
+	size_t i;
+	for(i=0; i < vJobs.size(); i++)
+	{
+		const job_space& job = vJobs[i];
+		if(job.iPoolId == iPoolId && job.iPrefix == iPrefix && job.bNiceHash == bNiceHash &&
+			strncmp(job.sJobID, sJobID, sizeof(job.sJobID)) == 0)
+			break;
+	}
+
+	if(i == vJobs.size())
+	{
+		job_space job;
+		job.iPoolId = iPoolId;
+		memcpy(job.sJobID, sJobID, sizeof(job.sJobID));
+		job.iPrefix = iPrefix;
+		job.bNiceHash = bNiceHash;
+		job.iNext = iPrefix;
+		job.iEnd = iPrefix + job_size(job);
+		job.bWarned = false;
+
+		if(vJobs.size() == iMaxJobs)
+			vJobs.pop_back();
+		vJobs.insert(vJobs.begin(), std::move(job));
+	}
+	else if(i != 0)
+	{
+		job_space job = std::move(vJobs[i]);
+		vJobs.erase(vJobs.begin() + i);
+		vJobs.insert(vJobs.begin(), std::move(job));
+	}
+
+	vJobs[0].iJobNo = iJobNo;
+	iCurrentJobNo = iJobNo;
+}
+
+bool nonce_alloc::claim(uint64_t iJobNo, uint32_t iMin, uint64_t& iStart, uint64_t& iEnd)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+
+	if(iCurrentJobNo == 0 || iJobNo != iCurrentJobNo)
+		return false;
+
+	job_space& job = vJobs[0];
+
+	// Leftovers from threads that moved on go first
+	for(size_t i=0; i < job.vFree.size(); i++)
+	{
+		range& r = job.vFree[i];
+		if(r.iEnd - r.iStart < iMin)
+			continue;
+
+		iStart = r.iStart;
+		iEnd = r.iEnd - r.iStart > iBlockSize ? r.iStart + iBlockSize : r.iEnd;
+
+		r.iStart = iEnd;
+		if(r.iStart == r.iEnd)
+			job.vFree.erase(job.vFree.begin() + i);
+		return true;
+	}
+
+	if(job.iEnd - job.iNext < iMin)
+	{
+		if(!job.bWarned)
+		{
+			job.bWarned = true;
+			printer::inst()->print_msg(L0, "Job %.16s ran out of nonces, threads wait for the next one.", job.sJobID);
+		}
+		return false;
+	}
+
+	iStart = job.iNext;
+	iEnd = job.iEnd - job.iNext > iBlockSize ? job.iNext + iBlockSize : job.iEnd;
+	job.iNext = iEnd;
+	return true;
+}
+
+void nonce_alloc::release(uint64_t iJobNo, uint64_t iStart, uint64_t iEnd)
+{
+	if(iStart >= iEnd)
+		return;
+
+	std::lock_guard<std::mutex> lck(mtx);
+
+	// By now the job is usually not the current one any more
+	for(job_space& job : vJobs)
+	{
+		if(job.iJobNo == iJobNo)
+		{
+			job.vFree.push_back({iStart, iEnd});
+			return;
+		}
+	}
+}
+
+double nonce_alloc::space_left()
+{
+	std::lock_guard<std::mutex> lck(mtx);
+
+	if(iCurrentJobNo == 0 || vJobs.empty())
+		return 0.0;
+
+	const job_space& job = vJobs[0];
+	uint64_t iLeft = job.iEnd - job.iNext;
+	for(const range& r : job.vFree)
+		iLeft += r.iEnd - r.iStart;
+
+	return double(iLeft) / double(job_size(job));
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+/*
+   Hands out nonces to the mining threads in blocks, so no two threads (and no two
+   resumes of the same job) ever hash the same nonce, whatever the thread count.
+   A thread that moves on to another job gives the unused rest of its block back and
+   the next thread on that job picks it up first. The state of the last few jobs is
+   kept, a job the pool sends again after a reconnect continues where it stopped.
+
+   NiceHash pools fix the top byte of the nonce, those jobs get 2^24 nonces instead of 2^32.
+*/
+class nonce_alloc
+{
+public:
+	static nonce_alloc* inst()
+	{
+		if (oInst == nullptr) oInst = new nonce_alloc;
+		return oInst;
+	};
+
+	// Called by the single writer of minethd::switch_work, before iJobNo is published
+	void new_job(uint64_t iJobNo, size_t iPoolId, const char* sJobID, const uint32_t* piNonce, bool bNiceHash, bool bStall);
+	// At least iMin consecutive nonces [iStart, iEnd) for job iJobNo, false if the job
+	// has run out of nonces or is no longer the current one
+	bool claim(uint64_t iJobNo, uint32_t iMin, uint64_t& iStart, uint64_t& iEnd);
+	// Gives back the unused part of a claimed block
+	void release(uint64_t iJobNo, uint64_t iStart, uint64_t iEnd);
+	// Share of the current job's nonces not handed out yet, 0.0 - 1.0
+	double space_left();
+
+private:
+	nonce_alloc() : iCurrentJobNo(0) {};
+	static nonce_alloc* oInst;
+
+	struct range
+	{
+		uint64_t iStart;
+		uint64_t iEnd;
+	};
+
+	struct job_space
+	{
+		size_t iPoolId;
+		char sJobID[64];
+		uint32_t iPrefix;
+		bool bNiceHash;
+		uint64_t iJobNo; // Job number it was last published under
+
+		uint64_t iNext; // Start of the untouched part
+		uint64_t iEnd;
+		std::vector<range> vFree; // Given back by threads
+		bool bWarned;
+	};
+
+	uint64_t job_size(const job_space& job);
+
+	// Most recently used first, vJobs[0] is what the threads work on unless iCurrentJobNo is 0
+	std::vector<job_space> vJobs;
+	uint64_t iCurrentJobNo;
+	std::mutex mtx;
+};
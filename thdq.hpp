@@ -1,49 +1,195 @@
 #pragma once
 
-#include <queue>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
-template <typename T>
+struct thdq_stats
+{
+	size_t depth;
+	size_t depth_max;
+	uint64_t pushes;
+	uint64_t push_ns_total;
+	uint64_t push_ns_max;
+};
+
+/*
+   Bounded multi-producer single-consumer ring. All slots are allocated once,
+   so a push only moves the item into its slot - no heap traffic and no lock.
+   Every slot carries a sequence number. Producers claim a position with a CAS
+   and publish it by bumping the sequence, the consumer waits for exactly that
+   value (see Vyukov's bounded MPMC queue, this is the single consumer half).
+
+   The consumer sleeps on a condition variable when the ring is empty. Producers
+   only take the mutex if they see it asleep. If the ring is full producers yield
+   until the consumer catches up, we never drop events.
+*/
+template <typename T, size_t iSize = 1024>
 class thdq
 {
+	static_assert(iSize >= 2 && (iSize & (iSize - 1)) == 0, "Queue size must be a power of 2");
+
 public:
+	thdq() : cells_(new cell[iSize]), enq_(0), deq_(0), sleeping_(false),
+		depth_max_(0), pushes_(0), push_ns_total_(0), push_ns_max_(0)
+	{
+		for(size_t i = 0; i < iSize; i++)
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	~thdq() { delete[] cells_; }
+
+	thdq(thdq const&) = delete;
+	thdq& operator=(thdq const&) = delete;
+
 	T pop()
 	{
-		std::unique_lock<std::mutex> mlock(mutex_);
-		while (queue_.empty()) { cond_.wait(mlock); }
-		auto item = std::move(queue_.front());
-		queue_.pop();
+		T item;
+		pop(item);
 		return item;
 	}
 
 	void pop(T& item)
 	{
-		std::unique_lock<std::mutex> mlock(mutex_);
-		while (queue_.empty()) { cond_.wait(mlock); }
-		item = queue_.front();
-		queue_.pop();
+		while(!try_pop(item))
+		{
+			std::unique_lock<std::mutex> mlock(mutex_);
+			sleeping_.store(true, std::memory_order_relaxed);
+			// Pairs with the fence in push - either we see the item, or the producer sees us asleep
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			cond_.wait(mlock, [this] { return !empty(); });
+			sleeping_.store(false, std::memory_order_relaxed);
+		}
 	}
 
 	void push(const T& item)
 	{
-		std::unique_lock<std::mutex> mlock(mutex_);
-		queue_.push(item);
-		mlock.unlock();
-		cond_.notify_one();
+		T copy(item);
+		push(std::move(copy));
 	}
 
 	void push(T&& item)
 	{
-		std::unique_lock<std::mutex> mlock(mutex_);
-		queue_.push(std::move(item));
-		mlock.unlock();
-		cond_.notify_one();
+		uint64_t iStart = get_ns();
+		size_t pos = enq_.load(std::memory_order_relaxed);
+		cell* c;
+
+		while(true)
+		{
+			c = &cells_[pos & iMask];
+			intptr_t dif = (intptr_t)c->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+
+			if(dif == 0)
+			{
+				if(enq_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else
+			{
+				// Full ring - the slot still holds an item from the previous lap
+				if(dif < 0)
+					std::this_thread::yield();
+				pos = enq_.load(std::memory_order_relaxed);
+			}
+		}
+
+		c->data = std::move(item);
+		c->seq.store(pos + 1, std::memory_order_release);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleeping_.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> mlock(mutex_);
+			cond_.notify_one();
+		}
+
+		size_t deq = deq_.load(std::memory_order_relaxed);
+		update_stats(pos + 1 > deq ? pos + 1 - deq : 0, get_ns() - iStart);
+	}
+
+	thdq_stats get_stats()
+	{
+		thdq_stats st;
+		size_t deq = deq_.load(std::memory_order_relaxed);
+		size_t enq = enq_.load(std::memory_order_relaxed);
+		st.depth = enq > deq ? enq - deq : 0;
+		st.depth_max = depth_max_.load(std::memory_order_relaxed);
+		st.pushes = pushes_.load(std::memory_order_relaxed);
+		st.push_ns_total = push_ns_total_.load(std::memory_order_relaxed);
+		st.push_ns_max = push_ns_max_.load(std::memory_order_relaxed);
+		return st;
 	}
 
 private:
-	std::queue<T> queue_;
+	constexpr static size_t iMask = iSize - 1;
+
+	struct cell
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	static uint64_t get_ns()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Only ever called by the consumer
+	bool try_pop(T& item)
+	{
+		size_t pos = deq_.load(std::memory_order_relaxed);
+		cell& c = cells_[pos & iMask];
+
+		if(c.seq.load(std::memory_order_acquire) != pos + 1)
+			return false;
+
+		item = std::move(c.data);
+		c.seq.store(pos + iSize, std::memory_order_release);
+		deq_.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool empty()
+	{
+		size_t pos = deq_.load(std::memory_order_relaxed);
+		return cells_[pos & iMask].seq.load(std::memory_order_acquire) != pos + 1;
+	}
+
+	static void store_max(std::atomic<uint64_t>& max, uint64_t val)
+	{
+		uint64_t cur = max.load(std::memory_order_relaxed);
+		while(cur < val && !max.compare_exchange_weak(cur, val, std::memory_order_relaxed));
+	}
+
+	void update_stats(size_t depth, uint64_t ns)
+	{
+		pushes_.fetch_add(1, std::memory_order_relaxed);
+		push_ns_total_.fetch_add(ns, std::memory_order_relaxed);
+		store_max(push_ns_max_, ns);
+		store_max(depth_max_, depth);
+	}
+
+	// The producer position, the consumer position, the sleep flag and the stats are each kept
+	// 64 bytes away from the others, so they never share a cache line. This is padding rather
+	// than alignas(64), an over-aligned class would need an aligned new that C++11 doesn't have.
+	cell* cells_;
+	char pad0_[64 - sizeof(cell*)];
+	std::atomic<size_t> enq_;
+	char pad1_[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> deq_;
+	char pad2_[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<bool> sleeping_;
 	std::mutex mutex_;
 	std::condition_variable cond_;
+	char pad3_[64];
+
+	std::atomic<uint64_t> depth_max_;
+	std::atomic<uint64_t> pushes_;
+	std::atomic<uint64_t> push_ns_total_;
+	std::atomic<uint64_t> push_ns_max_;
 };
@@ -0,0 +1,187 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include "topology.h"
+
+topology* topology::inst()
+{
+	// Worker threads can get here at the same time, a function local static is initialised exactly once
+	static topology oInst;
+	return &oInst;
+}
+
+#ifndef CONF_NO_HWLOC
+
+topology::topology() : topo(nullptr)
+{
+	hwloc_topology_t t;
+	if(hwloc_topology_init(&t) != 0)
+		return;
+
+	if(hwloc_topology_load(t) != 0)
+	{
+		hwloc_topology_destroy(t);
+		return;
+	}
+
+	topo = t;
+
+	int npus = hwloc_get_nbobjs_by_type(topo, HWLOC_OBJ_PU);
+	for(int i = 0; i < npus; i++)
+	{
+		hwloc_obj_t pu = hwloc_get_obj_by_type(topo, HWLOC_OBJ_PU, i);
+#if HWLOC_API_VERSION >= 0x20000
+		hwloc_obj_t l3 = hwloc_get_ancestor_obj_by_type(topo, HWLOC_OBJ_L3CACHE, pu);
+#else
+		// hwloc 1.x has a single cache type, the level is in the attributes
+		hwloc_obj_t l3 = pu->parent;
+		while(l3 != nullptr && !(l3->type == HWLOC_OBJ_CACHE && l3->attr->cache.depth == 3))
+			l3 = l3->parent;
+#endif // HWLOC_API_VERSION
+
+		if(pu->os_index >= vPus.size())
+			vPus.resize(pu->os_index + 1, pu_info{false, -1, -1});
+
+		pu_info& info = vPus[pu->os_index];
+		info.bValid = true;
+		info.iNode = pu->nodeset != nullptr ? hwloc_bitmap_first(pu->nodeset) : -1;
+		info.iL3 = l3 != nullptr ? l3->logical_index : -1;
+	}
+}
+
+topology::~topology()
+{
+	if(topo != nullptr)
+		hwloc_topology_destroy(topo);
+}
+
+void topology::core_pus(std::vector<std::vector<uint32_t>>& vCores)
+{
+	vCores.clear();
+	if(topo == nullptr)
+		return;
+
+	int ncores = hwloc_get_nbobjs_by_type(topo, HWLOC_OBJ_CORE);
+	for(int i = 0; i < ncores; i++)
+	{
+		hwloc_obj_t core = hwloc_get_obj_by_type(topo, HWLOC_OBJ_CORE, i);
+		std::vector<uint32_t> pus;
+
+		hwloc_obj_t pu = nullptr;
+		while((pu = hwloc_get_next_obj_inside_cpuset_by_type(topo, core->cpuset, HWLOC_OBJ_PU, pu)) != nullptr)
+			pus.push_back(pu->os_index);
+
+		if(!pus.empty())
+			vCores.push_back(pus);
+	}
+
+	// No core objects, every PU is on its own
+	if(vCores.empty())
+	{
+		int npus = hwloc_get_nbobjs_by_type(topo, HWLOC_OBJ_PU);
+		for(int i = 0; i < npus; i++)
+			vCores.push_back(std::vector<uint32_t>(1, hwloc_get_obj_by_type(topo, HWLOC_OBJ_PU, i)->os_index));
+	}
+}
+
+bool topology::bind_thread_memory(int64_t iPu)
+{
+	if(topo == nullptr || iPu < 0)
+		return false;
+
+	hwloc_obj_t pu = hwloc_get_pu_obj_by_os_index(topo, (unsigned)iPu);
+	if(pu == nullptr)
+		return false;
+
+#if HWLOC_API_VERSION >= 0x20000
+	return hwloc_set_membind(topo, pu->nodeset, HWLOC_MEMBIND_BIND,
+		HWLOC_MEMBIND_THREAD | HWLOC_MEMBIND_BYNODESET) == 0;
+#else
+	return hwloc_set_membind_nodeset(topo, pu->nodeset, HWLOC_MEMBIND_BIND, HWLOC_MEMBIND_THREAD) == 0;
+#endif // HWLOC_API_VERSION
+}
+
+bool topology::bind_area(void* pMem, size_t iLen, int64_t iPu)
+{
+	if(topo == nullptr || iPu < 0)
+		return false;
+
+	hwloc_obj_t pu = hwloc_get_pu_obj_by_os_index(topo, (unsigned)iPu);
+	if(pu == nullptr)
+		return false;
+
+	// Without HWLOC_MEMBIND_STRICT hwloc asks for the node as preferred, not as the only choice.
+	// A node that ran out of huge pages then gets them from its neighbour instead of a SIGBUS.
+#if HWLOC_API_VERSION >= 0x20000
+	return hwloc_set_area_membind(topo, pMem, iLen, pu->nodeset, HWLOC_MEMBIND_BIND,
+		HWLOC_MEMBIND_BYNODESET) == 0;
+#else
+	return hwloc_set_area_membind_nodeset(topo, pMem, iLen, pu->nodeset, HWLOC_MEMBIND_BIND, 0) == 0;
+#endif // HWLOC_API_VERSION
+}
+
+#else
+
+topology::topology()
+{
+}
+
+topology::~topology()
+{
+}
+
+void topology::core_pus(std::vector<std::vector<uint32_t>>& vCores)
+{
+	vCores.clear();
+}
+
+bool topology::bind_thread_memory(int64_t iPu)
+{
+	return false;
+}
+
+bool topology::bind_area(void* pMem, size_t iLen, int64_t iPu)
+{
+	return false;
+}
+
+#endif // CONF_NO_HWLOC
+
+const topology::pu_info* topology::find_pu(int64_t iPu)
+{
+	if(iPu < 0 || (size_t)iPu >= vPus.size() || !vPus[iPu].bValid)
+		return nullptr;
+	return &vPus[iPu];
+}
+
+int64_t topology::pu_node(int64_t iPu)
+{
+	const pu_info* info = find_pu(iPu);
+	return info != nullptr ? info->iNode : -1;
+}
+
+int64_t topology::pu_l3(int64_t iPu)
+{
+	const pu_info* info = find_pu(iPu);
+	return info != nullptr ? info->iL3 : -1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef CONF_NO_HWLOC
+#include <hwloc.h>
+#endif
+
+/*
+   The machine's topology, loaded once on first use and shared by the whole process.
+   Loading it takes a while on hosts with hundreds of PUs, so every thread asks here
+   instead of building its own. PUs are given by OS index (the affine_to_cpu number).
+   All queries answer -1 (or an empty list) if the topology isn't available.
+*/
+class topology
+{
+public:
+	static topology* inst();
+
+	// NUMA node (OS index) of the PU's memory
+	int64_t pu_node(int64_t iPu);
+	// Logical index of the L3 cache the PU belongs to
+	int64_t pu_l3(int64_t iPu);
+	// PUs grouped by core, in core order
+	void core_pus(std::vector<std::vector<uint32_t>>& vCores);
+
+	// Bind the memory the calling thread allocates from now on / the given range to the PU's node
+	bool bind_thread_memory(int64_t iPu);
+	bool bind_area(void* pMem, size_t iLen, int64_t iPu);
+
+#ifndef CONF_NO_HWLOC
+	// Shared hwloc handle for code that walks the tree itself, nullptr if it failed to load.
+	// Only read from it, and don't destroy it.
+	hwloc_topology_t get() { return topo; }
+#endif
+
+private:
+	topology();
+	~topology();
+
+	struct pu_info
+	{
+		bool bValid;
+		int64_t iNode;
+		int64_t iL3;
+	};
+
+	const pu_info* find_pu(int64_t iPu);
+
+	// Indexed by the PU's OS index
+	std::vector<pu_info> vPus;
+
+#ifndef CONF_NO_HWLOC
+	hwloc_topology_t topo;
+#endif
+};
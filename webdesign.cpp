@@ -123,6 +123,8 @@ extern const char sHtmlHashrateTableRow [] =
 extern const char sHtmlHashrateBodyLow [] =
 		"<tr><th>Totals:</th><td>%s</td><td>%s</td><td>%s</td></tr>"
 		"<tr><th>Highest:</th><td>%s</td><td colspan='2'></td></tr>"
+		"<tr><th>Starved:</th><td>%.1f s</td><td colspan='3'></td></tr>"
+		"<tr><th>Hash time:</th><td colspan='4'>p50 %s ms, p99 %s ms, jitter %s ms</td></tr>"
 	"</table>"
 	"</div></div></body></html>";
 
@@ -132,6 +134,7 @@ extern const char sHtmlConnectionBodyHigh [] =
 		"<tr><th>Pool address</th><td>%s</td></tr>"
 		"<tr><th>Connected since</th><td>%s</td></tr>"
 		"<tr><th>Pool ping time</th><td>%u ms</td></tr>"
+		"<tr><th>Event queue</th><td>%s</td></tr>"
 	"</table>"
 	"<h4>Network error log</h4>"
 	"<table>"
@@ -184,7 +187,12 @@ extern const char sJsonApiFormat [] =
 	"\"hashrate\":{"
 		"\"threads\":[%s],"
 		"\"total\":%s,"
-		"\"highest\":%s"
+		"\"highest\":%s,"
+		"\"starved\":%.1f,"
+		"\"latency\":[%s],"
+		"\"latency_total\":%s,"
+		"\"pages\":[%s],"
+		"\"nonce_left\":%.6f"
 	"},"
 
 	"\"results\":{"
@@ -202,6 +210,14 @@ extern const char sJsonApiFormat [] =
 		"\"uptime\":%llu,"
 		"\"ping\":%llu,"
 		"\"error_log\":[%s]"
+	"},"
+
+	"\"event_queue\":{"
+		"\"depth\":%llu,"
+		"\"depth_max\":%llu,"
+		"\"pushes\":%llu,"
+		"\"push_ns_avg\":%llu,"
+		"\"push_ns_max\":%llu"
 	"}"
 "}";
 